@@ -1,6 +1,8 @@
-﻿#include "position.hpp"
+﻿#include "init.hpp"
+#include "position.hpp"
 #include <iostream>
-#include <set>
+#include <unordered_map>
+#include <algorithm>
 
 HuffmanCodedPos* read_hcps(const char* path, s64& entryNum)
 {
@@ -22,17 +24,6 @@ HuffmanCodedPos* read_hcps(const char* path, s64& entryNum)
 	return hcpes;
 }
 
-bool operator<(const HuffmanCodedPos& l, const HuffmanCodedPos& r)
-{
-	for (size_t i = 0; i < 32; i++) {
-		if (l.data[i] < r.data[i])
-			return true;
-		if (l.data[i] > r.data[i])
-			return false;
-	}
-	return false;
-}
-
 int main(int argc, char** argv)
 {
 	if (argc < 3) {
@@ -44,6 +35,10 @@ int main(int argc, char** argv)
 	const char* delete_hcp_path = argv[2];
 	const char* dst_hcp_path = argv[3];
 
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
 	s64 srcEntryNum;
 	s64 delEntryNum;
 	HuffmanCodedPos *srcHcpes = read_hcps(src_hcp_path, srcEntryNum);
@@ -51,14 +46,24 @@ int main(int argc, char** argv)
 
 	std::ofstream ofs(dst_hcp_path, std::ios::binary);
 
-	std::set<HuffmanCodedPos> delSet;
-	for (s64 i = 0; i < delEntryNum; i++) {
-		delSet.insert(delHcpes[i]);
-	}
+	// 局面のハッシュ値で絞り込み、ハッシュ値が一致したものは hcp のバイト列を比較する
+	// 不正な符号の局面はハッシュ値を 0 とし、hcp のバイト列だけで比較する。
+	const auto keyOf = [](const HuffmanCodedPos& hcp) {
+		Key key;
+		return Position::getKey(hcp, key) ? key : Key(0);
+	};
+	std::unordered_multimap<Key, const HuffmanCodedPos*> delMap;
+	delMap.reserve(delEntryNum);
+	for (s64 i = 0; i < delEntryNum; i++)
+		delMap.emplace(keyOf(delHcpes[i]), &delHcpes[i]);
 
 	s64 dstEntryNum = 0;
 	for (s64 i = 0; i < srcEntryNum; i++) {
-		if (delSet.find(srcHcpes[i]) == delSet.end()) {
+		const auto range = delMap.equal_range(keyOf(srcHcpes[i]));
+		const bool found = std::any_of(range.first, range.second, [&](const std::pair<const Key, const HuffmanCodedPos*>& del) {
+			return std::memcmp(del.second->data, srcHcpes[i].data, sizeof(HuffmanCodedPos)) == 0;
+		});
+		if (!found) {
 			ofs.write(reinterpret_cast<char*>(&srcHcpes[i]), sizeof(HuffmanCodedPos));
 			dstEntryNum++;
 		}
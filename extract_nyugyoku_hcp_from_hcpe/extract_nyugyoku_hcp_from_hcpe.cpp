@@ -107,6 +107,9 @@ int main(int argc, char *argv[]) {
 			d = 0;
 		}
 		HuffmanCodedPosAndEval& hcpe = inhcpevec[d];
+		// ԑ̋ʂGwɂȂǖʂ́AɏO
+		if (!hcpe.hcp.kingInOpponentField(hcpe.hcp.turn()))
+			continue;
 		pos.set(hcpe.hcp, nullptr);
 
 		if (before_nyugyoku(pos)) {
@@ -0,0 +1,167 @@
+﻿#ifndef HCP_DECODER_FEATURES_HPP
+#define HCP_DECODER_FEATURES_HPP
+
+// policy network, value network の入力特徴量の作成
+// hcp_decoder モジュールと、test の速度計測から使う。
+
+#include "position.hpp"
+
+const int MAX_HPAWN_NUM = 8; // 歩の持ち駒の上限
+const int MAX_HLANCE_NUM = 4;
+const int MAX_HKNIGHT_NUM = 4;
+const int MAX_HSILVER_NUM = 4;
+const int MAX_HGOLD_NUM = 4;
+const int MAX_HBISHOP_NUM = 2;
+const int MAX_HROOK_NUM = 2;
+
+const u32 MAX_PIECES_IN_HAND[] = {
+	MAX_HPAWN_NUM, // PAWN
+	MAX_HLANCE_NUM, // LANCE
+	MAX_HKNIGHT_NUM, // KNIGHT
+	MAX_HSILVER_NUM, // SILVER
+	MAX_HGOLD_NUM, // GOLD
+	MAX_HBISHOP_NUM, // BISHOP
+	MAX_HROOK_NUM, // ROOK
+};
+const u32 MAX_PIECES_IN_HAND_SUM = MAX_HPAWN_NUM + MAX_HLANCE_NUM + MAX_HKNIGHT_NUM + MAX_HSILVER_NUM + MAX_HGOLD_NUM + MAX_HBISHOP_NUM + MAX_HROOK_NUM;
+const u32 MAX_FEATURES2_HAND_NUM = (int)ColorNum * MAX_PIECES_IN_HAND_SUM;
+const u32 MAX_FEATURES2_NUM = MAX_FEATURES2_HAND_NUM + 1/*王手*/;
+const int MAX_FEATURES1_ACTIVE_NUM = 40; // 盤上の駒の最大数。疎な形式の features1 の要素数
+
+// 入力特徴量の 1 面の形式
+// float[SquareNum], u8[SquareNum] : 1 升を 1 要素で表す。
+// PackedPlane : 1 面の 81 升を u64 2 個の bit に詰める。SQ11 が bits[0] の最下位 bit
+struct PackedPlane {
+	u64 bits[2];
+};
+static_assert(sizeof(PackedPlane) == 16, "");
+
+// 1 面の要素の型と要素数
+template <typename PLANE> struct PlaneTraits;
+template <typename T, size_t N> struct PlaneTraits<T[N]> {
+	typedef T element_type;
+	static const int width = (int)N;
+};
+template <> struct PlaneTraits<PackedPlane> {
+	typedef u64 element_type;
+	static const int width = sizeof(PackedPlane::bits) / sizeof(u64);
+};
+
+template <typename T, size_t N>
+inline void set_feature(T(&plane)[N], const Square sq) {
+	plane[sq] = (T)1;
+}
+inline void set_feature(PackedPlane& plane, const Square sq) {
+	plane.bits[sq >> 6] |= UINT64_C(1) << (sq & 63);
+}
+template <typename T, size_t N>
+inline void fill_feature(T(&plane)[N]) {
+	std::fill_n(plane, N, (T)1);
+}
+inline void fill_feature(PackedPlane& plane) {
+	plane.bits[0] = ~UINT64_C(0);
+	plane.bits[1] = (UINT64_C(1) << ((int)SquareNum - 64)) - 1;
+}
+
+// make input features (持ち駒と王手)
+// us : 特徴量を作成する視点。通常は position.turn()。履歴の局面では現局面の手番にする。
+template <typename PLANE, typename POSITION>
+inline void make_input_features2(const POSITION& position, const Color us, PLANE(*features2)[MAX_FEATURES2_NUM]) {
+	PLANE(*features2_hand)[ColorNum][MAX_PIECES_IN_HAND_SUM] = reinterpret_cast<PLANE(*)[ColorNum][MAX_PIECES_IN_HAND_SUM]>(features2);
+	for (Color c = Black; c < ColorNum; ++c) {
+		// 白の場合、色を反転
+		Color c2 = c;
+		if (us == White) {
+			c2 = oppositeColor(c);
+		}
+
+		// hand
+		Hand hand = position.hand(c);
+		int p = 0;
+		for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
+			u32 num = hand.numOf(hp);
+			if (num >= MAX_PIECES_IN_HAND[hp]) {
+				num = MAX_PIECES_IN_HAND[hp];
+			}
+			for (u32 i = 0; i < num; i++) {
+				fill_feature((*features2_hand)[c2][p + i]);
+			}
+			p += MAX_PIECES_IN_HAND[hp];
+		}
+	}
+
+	// is check
+	if (position.inCheck()) {
+		fill_feature((*features2)[MAX_FEATURES2_HAND_NUM]);
+	}
+}
+template <typename PLANE, typename POSITION>
+inline void make_input_features2(const POSITION& position, PLANE(*features2)[MAX_FEATURES2_NUM]) {
+	make_input_features2(position, position.turn(), features2);
+}
+
+// 入力特徴量の升の位置。[手番][左右反転][升]
+// 白の場合は盤面を180度回転し、左右反転する場合は 1筋 <-> 9筋 を入れ替える。
+struct FeatureSquareTable {
+	u8 square[ColorNum][2][SquareNum];
+
+	constexpr FeatureSquareTable() : square() {
+		const int square_num = SquareNum;
+		const int file_num = FileNum;
+		const int rank_num = RankNum;
+		for (int c = 0; c < ColorNum; c++) {
+			for (int mirror = 0; mirror < 2; mirror++) {
+				for (int sq = 0; sq < square_num; sq++) {
+					int sq2 = (c == White) ? square_num - 1 - sq : sq;
+					if (mirror)
+						sq2 = (file_num - 1 - sq2 / rank_num) * rank_num + sq2 % rank_num;
+					square[c][mirror][sq] = (u8)sq2;
+				}
+			}
+		}
+	}
+};
+constexpr FeatureSquareTable FEATURE_SQUARE_TABLE;
+
+inline Square feature_square(const Color us, const bool mirror, const Square sq) {
+	return static_cast<Square>(FEATURE_SQUARE_TABLE.square[us][mirror][sq]);
+}
+
+// make input features (盤上の駒)
+// 手番毎に特殊化し、駒の種類毎の Bitboard の 1 の bit だけを調べる。
+template <Color US, typename PLANE, typename POSITION>
+inline void make_input_features1(const POSITION& position, PLANE(*features1)[ColorNum][PieceTypeNum - 1], const bool mirror) {
+	const u8* table = FEATURE_SQUARE_TABLE.square[US][mirror];
+	for (Color c = Black; c < ColorNum; ++c) {
+		// 白の場合、色を反転
+		const Color c2 = (US == White) ? oppositeColor(c) : c;
+		const Bitboard bbc = position.bbOf(c);
+		for (PieceType pt = Pawn; pt < PieceTypeNum; ++pt) {
+			Bitboard bb = position.bbOf(pt) & bbc;
+			while (bb) {
+				const Square sq = bb.firstOneFromSQ11();
+				set_feature((*features1)[c2][pt - 1], static_cast<Square>(table[sq]));
+			}
+		}
+	}
+}
+
+// make input features
+// Position, BoardOnlyPosition のどちらからでも作成出来る。
+// us : 特徴量を作成する視点。make_input_features2 を参照。
+// mirror : true なら盤面を左右反転する (1筋 <-> 9筋)。持ち駒と王手は変わらない。
+template <typename PLANE, typename POSITION>
+inline void make_input_features(const POSITION& position, const Color us, PLANE(*features1)[ColorNum][PieceTypeNum - 1], PLANE(*features2)[MAX_FEATURES2_NUM], const bool mirror = false) {
+	if (us == Black)
+		make_input_features1<Black>(position, features1, mirror);
+	else
+		make_input_features1<White>(position, features1, mirror);
+
+	make_input_features2(position, us, features2);
+}
+template <typename PLANE, typename POSITION>
+inline void make_input_features(const POSITION& position, PLANE(*features1)[ColorNum][PieceTypeNum - 1], PLANE(*features2)[MAX_FEATURES2_NUM], const bool mirror = false) {
+	make_input_features(position, position.turn(), features1, features2, mirror);
+}
+
+#endif // #ifndef HCP_DECODER_FEATURES_HPP
@@ -3,38 +3,38 @@
 #include <boost/python/numpy.hpp>
 #include <numeric>
 #include <algorithm>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <string>
+#include <functional>
+#include <chrono>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "init.hpp"
 #include "position.hpp"
 #include "move.hpp"
 #include "generateMoves.hpp"
+#include "features.hpp"
+#include "shard_reader.hpp"
 
 namespace p = boost::python;
 namespace np = boost::python::numpy;
 
 #define LEN(array) (sizeof(array) / sizeof(array[0]))
 
-const int MAX_HPAWN_NUM = 8; // 歩の持ち駒の上限
-const int MAX_HLANCE_NUM = 4;
-const int MAX_HKNIGHT_NUM = 4;
-const int MAX_HSILVER_NUM = 4;
-const int MAX_HGOLD_NUM = 4;
-const int MAX_HBISHOP_NUM = 2;
-const int MAX_HROOK_NUM = 2;
-
-const u32 MAX_PIECES_IN_HAND[] = {
-	MAX_HPAWN_NUM, // PAWN
-	MAX_HLANCE_NUM, // LANCE
-	MAX_HKNIGHT_NUM, // KNIGHT
-	MAX_HSILVER_NUM, // SILVER
-	MAX_HGOLD_NUM, // GOLD
-	MAX_HBISHOP_NUM, // BISHOP
-	MAX_HROOK_NUM, // ROOK
-};
-const u32 MAX_PIECES_IN_HAND_SUM = MAX_HPAWN_NUM + MAX_HLANCE_NUM + MAX_HKNIGHT_NUM + MAX_HSILVER_NUM + MAX_HGOLD_NUM + MAX_HBISHOP_NUM + MAX_HROOK_NUM;
-const u32 MAX_FEATURES2_HAND_NUM = (int)ColorNum * MAX_PIECES_IN_HAND_SUM;
-const u32 MAX_FEATURES2_NUM = MAX_FEATURES2_HAND_NUM + 1/*王手*/;
-
 // 移動の定数
 enum MOVE_DIRECTION {
 	UP, UP_LEFT, UP_RIGHT, LEFT, RIGHT, DOWN, DOWN_LEFT, DOWN_RIGHT,
@@ -70,7 +70,7 @@ const MOVE_DIRECTION PROM_SILVER_MOVE_DIRECTION[] = { UP, UP_LEFT, UP_RIGHT, LEF
 const MOVE_DIRECTION PROM_BISHOP_MOVE_DIRECTION[] = { UP, UP_LEFT, UP_RIGHT, LEFT, RIGHT, DOWN, DOWN_LEFT, DOWN_RIGHT };
 const MOVE_DIRECTION PROM_ROOK_MOVE_DIRECTION[] = { UP, UP_LEFT, UP_RIGHT, LEFT, RIGHT, DOWN, DOWN_LEFT, DOWN_RIGHT };
 
-const int PIECE_MOVE_DIRECTION_INDEX[][16] = {
+constexpr int PIECE_MOVE_DIRECTION_INDEX[][16] = {
 	{ 0, -1, -1, -1, -1, -1, -1, -1, 1, -1, -1, -1, -1, -1, -1, -1 }, // PAWN
 	{ 0, -1, -1, -1, -1, -1, -1, -1, 1, -1, -1, -1, -1, -1, -1, -1 }, // LANCE
 	{ 0, 1, 2, 3, 4, -1, -1, -1, -1, 5, 6, 7, 8, -1, -1, -1 }, // KNIGHT
@@ -85,6 +85,7 @@ const int PIECE_MOVE_DIRECTION_INDEX[][16] = {
 	{ 0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }, // PROM_SILVER
 	{ 0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1 }, // PROM_BISHOP
 	{ 0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1 }, // PROM_ROOK
+	{ 0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1 }, // 龍を PieceType で引いた時に範囲外にならないよう、PROM_ROOK と同じ行を置く
 };
 
 // classification label
@@ -104,7 +105,7 @@ const int PROM_BISHOP_MOVE_DIRECTION_LABEL = PROM_SILVER_MOVE_DIRECTION_LABEL +
 const int PROM_ROOK_MOVE_DIRECTION_LABEL = PROM_BISHOP_MOVE_DIRECTION_LABEL + LEN(PROM_BISHOP_MOVE_DIRECTION);
 const int MOVE_DIRECTION_LABEL_NUM = PROM_ROOK_MOVE_DIRECTION_LABEL + LEN(PROM_ROOK_MOVE_DIRECTION);
 
-const int PIECE_MOVE_DIRECTION_LABEL[] = {
+constexpr int PIECE_MOVE_DIRECTION_LABEL[] = {
 	0,
 	PAWN_MOVE_DIRECTION_LABEL, LANCE_MOVE_DIRECTION_LABEL, KNIGHT_MOVE_DIRECTION_LABEL, SILVER_MOVE_DIRECTION_LABEL,
 	BISHOP_MOVE_DIRECTION_LABEL, ROOK_MOVE_DIRECTION_LABEL,
@@ -114,51 +115,98 @@ const int PIECE_MOVE_DIRECTION_LABEL[] = {
 	PROM_BISHOP_MOVE_DIRECTION_LABEL, PROM_ROOK_MOVE_DIRECTION_LABEL
 };
 
-// make input features
-inline void make_input_features(const Position& position, float(*features1)[ColorNum][PieceTypeNum - 1][SquareNum], float(*features2)[MAX_FEATURES2_NUM][SquareNum]) {
-	float(*features2_hand)[ColorNum][MAX_PIECES_IN_HAND_SUM][SquareNum] = reinterpret_cast<float(*)[ColorNum][MAX_PIECES_IN_HAND_SUM][SquareNum]>(features2);
-	for (Color c = Black; c < ColorNum; ++c) {
-		// 白の場合、色を反転
-		Color c2 = c;
-		if (position.turn() == White) {
-			c2 = oppositeColor(c);
-		}
-
-		for (PieceType pt = Pawn; pt < PieceTypeNum; ++pt) {
-			Bitboard bb = position.bbOf(pt, c);
-			for (Square sq = SQ11; sq < SquareNum; ++sq) {
-				// 白の場合、盤面を180度回転
-				Square sq2 = sq;
-				if (position.turn() == White) {
-					sq2 = SQ99 - sq;
-				}
+// make_move が出力する指し手のラベルの数 (移動方向 + 持ち駒の種類) * 移動先
+const int MOVE_LABEL_NUM = (int)SquareNum * (MOVE_DIRECTION_LABEL_NUM + (int)HandPieceNum);
+const int MOVE_LABEL_WORD_NUM = (MOVE_LABEL_NUM + 63) / 64; // bit に詰めた場合の u64 の数
 
-				if (bb.isSet(sq)) {
-					(*features1)[c2][pt - 1][sq2] = 1.0f;
-				}
+// make_move で使う表
+// direction : [移動元][移動先] の移動方向。升は手番から見た位置 (feature_square() で変換した位置)
+// direction_label : [駒の種類][移動方向 (成りは + 8)] の移動方向のラベル
+struct MoveLabelTable {
+	u8 direction[SquareNum][SquareNum];
+	s8 direction_label[PieceTypeNum][16];
+
+	constexpr MoveLabelTable() : direction(), direction_label() {
+		const int square_num = SquareNum;
+		const int rank_num = RankNum;
+		for (int from = 0; from < square_num; from++) {
+			for (int to = 0; to < square_num; to++) {
+				const int dir_x = from / rank_num - to / rank_num;
+				const int dir_y = to % rank_num - from % rank_num;
+				MOVE_DIRECTION move_direction = UP;
+				if (dir_y < 0 && dir_x == 0) move_direction = UP;
+				else if (dir_y < 0 && dir_x < 0) move_direction = UP_LEFT;
+				else if (dir_y < 0 && dir_x > 0) move_direction = UP_RIGHT;
+				else if (dir_y == 0 && dir_x < 0) move_direction = LEFT;
+				else if (dir_y == 0 && dir_x > 0) move_direction = RIGHT;
+				else if (dir_y > 0 && dir_x == 0) move_direction = DOWN;
+				else if (dir_y > 0 && dir_x < 0) move_direction = DOWN_LEFT;
+				else if (dir_y > 0 && dir_x > 0) move_direction = DOWN_RIGHT;
+				direction[from][to] = (u8)move_direction;
 			}
 		}
-		// hand
-		Hand hand = position.hand(c);
-		int p = 0;
-		for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
-			u32 num = hand.numOf(hp);
-			if (num >= MAX_PIECES_IN_HAND[hp]) {
-				num = MAX_PIECES_IN_HAND[hp];
-			}
-			std::fill_n((*features2_hand)[c2][p], (int)SquareNum * num, 1.0f);
-			p += MAX_PIECES_IN_HAND[hp];
+		for (int pt = 0; pt < PieceTypeNum; pt++) {
+			for (int move_direction = 0; move_direction < 16; move_direction++)
+				direction_label[pt][move_direction] = (s8)(PIECE_MOVE_DIRECTION_LABEL[pt] + PIECE_MOVE_DIRECTION_INDEX[pt][move_direction]);
 		}
 	}
+};
+constexpr MoveLabelTable MOVE_LABEL_TABLE;
+
+// HuffmanCodedPos から Position を経由せずに入力特徴量を作成する。
+// 盤上の駒は復号した時点で、手番に合わせて色を反転、180度回転した位置に書き込む。
+// position には make_move() 等で使う為の盤面が復元される。
+// mirror : true なら盤面を左右反転する。
+template <typename PLANE>
+inline bool decode_input_features(const HuffmanCodedPos& hcp, BoardOnlyPosition& position, PLANE(*features1)[ColorNum][PieceTypeNum - 1], PLANE(*features2)[MAX_FEATURES2_NUM], const bool mirror = false) {
+	const bool result = position.set(hcp, [&](const Piece pc, const Square sq) {
+		const Color c = pieceToColor(pc);
+		const PieceType pt = pieceToPieceType(pc);
+		// 白の場合、色を反転、盤面を180度回転
+		const Color c2 = (position.turn() == White) ? oppositeColor(c) : c;
+		set_feature((*features1)[c2][pt - 1], feature_square(position.turn(), mirror, sq));
+	});
+
+	make_input_features2(position, features2);
 
-	// is check
-	if (position.inCheck()) {
-		std::fill_n((*features2)[MAX_FEATURES2_HAND_NUM], SquareNum, 1.0f);
+	return result;
+}
+
+// HuffmanCodedPos から入力特徴量を疎な形式で作成する。
+// indices : features1 を (ColorNum * (PieceTypeNum - 1) * SquareNum) の1次元にしたときの、1 になる位置。残りは -1 で埋める。
+// hands : 手番から見た持ち駒の枚数。features2 と同じく上限で打ち切る。
+// check : 王手なら 1
+// mirror : true なら盤面を左右反転する。
+inline bool decode_sparse_input_features(const HuffmanCodedPos& hcp, BoardOnlyPosition& position, s16 (*indices)[MAX_FEATURES1_ACTIVE_NUM], u8 (*hands)[ColorNum][HandPieceNum], u8 *check, const bool mirror = false) {
+	int n = 0;
+	const bool result = position.set(hcp, [&](const Piece pc, const Square sq) {
+		if (n >= MAX_FEATURES1_ACTIVE_NUM)
+			return;
+		const Color c = pieceToColor(pc);
+		const PieceType pt = pieceToPieceType(pc);
+		// 白の場合、色を反転、盤面を180度回転
+		const Color c2 = (position.turn() == White) ? oppositeColor(c) : c;
+		(*indices)[n++] = (s16)(((int)c2 * (PieceTypeNum - 1) + pt - 1) * (int)SquareNum + feature_square(position.turn(), mirror, sq));
+	});
+	std::fill(*indices + n, *indices + MAX_FEATURES1_ACTIVE_NUM, (s16)-1);
+
+	for (Color c = Black; c < ColorNum; ++c) {
+		// 白の場合、色を反転
+		const Color c2 = (position.turn() == White) ? oppositeColor(c) : c;
+		const Hand hand = position.hand(c);
+		for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
+			(*hands)[c2][hp] = (u8)std::min(hand.numOf(hp), MAX_PIECES_IN_HAND[hp]);
+		}
 	}
+
+	*check = position.inCheck() ? 1 : 0;
+
+	return result;
 }
 
 // make result
-inline void make_result(const GameResult gameResult, const Position& position, float *result) {
+template <typename POSITION>
+inline void make_result(const GameResult gameResult, const POSITION& position, float *result) {
 	if (gameResult == Draw) {
 		*result = 0.0f;
 	}
@@ -174,78 +222,296 @@ inline void make_result(const GameResult gameResult, const Position& position, f
 }
 
 // make move
-inline void make_move(const u16 bestMove16, const Position& position, int *move) {
+// mirror : true なら左右反転した盤面での指し手にする。移動方向の左右も入れ替わる。
+// 移動先、打つ駒が範囲外の不正な指し手は -1 になる。
+template <typename POSITION>
+inline void make_move(const u16 bestMove16, const POSITION& position, int *move, const bool mirror = false) {
 	// see: move.hpp : 30
 	// xxxxxxxx x1111111  移動先
 	// xx111111 1xxxxxxx  移動元。駒打ちの際には、PieceType + SquareNum - 1
 	// x1xxxxxx xxxxxxxx  1 なら成り
-	u16 to_sq = bestMove16 & 0b1111111;
-	u16 from_sq = (bestMove16 >> 7) & 0b1111111;
+	const int to = bestMove16 & 0b1111111;
+	const int from_sq = (bestMove16 >> 7) & 0b1111111;
+	// 表を範囲外で引かないよう、先に弾く
+	if (to >= SquareNum || from_sq - (int)SquareNum >= (int)HandPieceNum) {
+		*move = -1;
+		return;
+	}
+	const Color us = position.turn();
+	// 白の場合、盤面を180度回転
+	const Square to_sq = feature_square(us, mirror, static_cast<Square>(to));
 
 	// move direction
 	int move_direction_label;
 	if (from_sq < SquareNum) {
 		// 駒の種類
-		PieceType move_piece = pieceToPieceType(position.piece((Square)from_sq));
+		const PieceType move_piece = pieceToPieceType(position.piece(static_cast<Square>(from_sq)));
+		// 左右反転すると、移動方向の LEFT と RIGHT が入れ替わる。
+		const Square from = feature_square(us, mirror, static_cast<Square>(from_sq));
+		// promote の bit を移動方向の 8 の bit にする (MOVE_DIRECTION_PROMOTED)
+		const int move_direction = MOVE_LABEL_TABLE.direction[from][to_sq] | ((bestMove16 >> 11) & 0b1000);
+		move_direction_label = MOVE_LABEL_TABLE.direction_label[move_piece][move_direction];
+	}
+	// 持ち駒の場合
+	else {
+		const int hand_piece = from_sq - (int)SquareNum;
+		move_direction_label = MOVE_DIRECTION_LABEL_NUM + hand_piece;
+	}
 
-		// 白の場合、盤面を180度回転
-		if (position.turn() == White) {
-			to_sq = (u16)SQ99 - to_sq;
-			from_sq = (u16)SQ99 - from_sq;
-		}
+	*move = (int)SquareNum * move_direction_label + to_sq;
+}
 
-		const div_t to_d = div(to_sq, 9);
-		const int to_x = to_d.quot;
-		const int to_y = to_d.rem;
-		const div_t from_d = div(from_sq, 9);
-		const int from_x = from_d.quot;
-		const int from_y = from_d.rem;
-		const int dir_x = from_x - to_x;
-		const int dir_y = to_y - from_y;
+// 1 局面分の入力特徴量、評価値、指し手、勝敗を作成する。
+template <typename PLANE>
+inline void decode_hcpe_with_value(const HuffmanCodedPosAndEval& hcpe, BoardOnlyPosition& position, PLANE(*features1)[ColorNum][PieceTypeNum - 1], PLANE(*features2)[MAX_FEATURES2_NUM], float *value, int *move, float *result, const bool mirror = false) {
+	// input features
+	decode_input_features(hcpe.hcp, position, features1, features2, mirror);
 
-		MOVE_DIRECTION move_direction;
-		if (dir_y < 0 && dir_x == 0) {
-			move_direction = UP;
-		}
-		else if (dir_y < 0 && dir_x < 0) {
-			move_direction = UP_LEFT;
-		}
-		else if (dir_y < 0 && dir_x > 0) {
-			move_direction = UP_RIGHT;
-		}
-		else if (dir_y == 0 && dir_x < 0) {
-			move_direction = LEFT;
-		}
-		else if (dir_y == 0 && dir_x > 0) {
-			move_direction = RIGHT;
-		}
-		else if (dir_y > 0 && dir_x == 0) {
-			move_direction = DOWN;
+	// eval
+	*value = tanh((float)hcpe.eval * 0.00067492f);
+
+	// move
+	make_move(hcpe.bestMove16, position, move, mirror);
+
+	// game result
+	make_result(hcpe.gameResult, position, result);
+}
+
+// decode_* で使用するスレッド数
+int g_num_threads = 1;
+
+void set_num_threads(const int num_threads) {
+	g_num_threads = std::max(1, num_threads);
+}
+
+int get_num_threads() {
+	return g_num_threads;
+}
+
+// スコープ内でGILを解放する。
+// ndarrayのデータのポインタは、解放する前に取得しておくこと。
+class ScopedGILRelease {
+public:
+	ScopedGILRelease() : state_(PyEval_SaveThread()) {}
+	~ScopedGILRelease() { PyEval_RestoreThread(state_); }
+
+private:
+	PyThreadState* state_;
+};
+
+// [0, len) を g_num_threads 個に分割して、f(begin, end) を並列に実行する。
+template <typename F>
+void parallel_for(const int len, F f) {
+	const int num_threads = std::max(1, std::min(g_num_threads, len));
+	if (num_threads == 1) {
+		f(0, len);
+		return;
+	}
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads - 1);
+	for (int t = 1; t < num_threads; t++) {
+		const int begin = (int)((s64)len * t / num_threads);
+		const int end = (int)((s64)len * (t + 1) / num_threads);
+		threads.emplace_back(f, begin, end);
+	}
+	f(0, (int)((s64)len / num_threads));
+	for (auto& th : threads)
+		th.join();
+}
+
+// 常駐するスレッドで [0, len) を num_threads 個に分割して、f(begin, end, thread_id) を並列に実行する。
+// thread_id は 0 以上 num_threads 未満で、スレッド毎の作業領域の添え字に使う。
+// 呼び出したスレッドも thread_id = 0 として実行する。
+class WorkerPool {
+public:
+	explicit WorkerPool(const int num_threads) : num_threads_(std::max(1, num_threads)) {
+		threads_.reserve(num_threads_ - 1);
+		for (int t = 1; t < num_threads_; t++)
+			threads_.emplace_back(&WorkerPool::worker, this, t);
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
 		}
-		else if (dir_y > 0 && dir_x < 0) {
-			move_direction = DOWN_LEFT;
+		start_cond_.notify_all();
+		for (auto& th : threads_)
+			th.join();
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	void run(const int len, const std::function<void(int, int, int)>& f) {
+		if (num_threads_ == 1) {
+			f(0, len, 0);
+			return;
 		}
-		else if (dir_y > 0 && dir_x > 0) {
-			move_direction = DOWN_RIGHT;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			job_ = &f;
+			len_ = len;
+			running_ = num_threads_ - 1;
+			generation_++;
 		}
+		start_cond_.notify_all();
+
+		const int end = (int)((s64)len / num_threads_);
+		if (end > 0)
+			f(0, end, 0);
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_cond_.wait(lock, [this] { return running_ == 0; });
+		job_ = nullptr;
+	}
 
-		// promote
-		if ((bestMove16 & 0b100000000000000) > 0) {
-			move_direction = MOVE_DIRECTION_PROMOTED[move_direction];
+	int num_threads() const { return num_threads_; }
+
+private:
+	void worker(const int thread_id) {
+		u64 generation = 0;
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			start_cond_.wait(lock, [&] { return stop_ || generation_ != generation; });
+			if (stop_)
+				return;
+			generation = generation_;
+			const std::function<void(int, int, int)>& f = *job_;
+			const int begin = (int)((s64)len_ * thread_id / num_threads_);
+			const int end = (int)((s64)len_ * (thread_id + 1) / num_threads_);
+			lock.unlock();
+
+			if (begin < end)
+				f(begin, end, thread_id);
+
+			lock.lock();
+			if (--running_ == 0)
+				done_cond_.notify_one();
 		}
-		move_direction_label = PIECE_MOVE_DIRECTION_LABEL[move_piece] + PIECE_MOVE_DIRECTION_INDEX[move_piece][move_direction];
 	}
-	// 持ち駒の場合
+
+	const int num_threads_;
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable start_cond_;
+	std::condition_variable done_cond_;
+	const std::function<void(int, int, int)>* job_ = nullptr;
+	int len_ = 0;
+	int running_ = 0;
+	u64 generation_ = 0;
+	bool stop_ = false;
+};
+
+template <typename PLANE>
+struct FeaturePlaneTag {
+	typedef PLANE type;
+};
+
+// ndfeatures1, ndfeatures2 の dtype に合わせた形式で f(FeaturePlaneTag<PLANE>()) を呼ぶ。
+//   np.float32 : (len, 2, 14, 81), (len, 57, 81) の float
+//   np.uint8 : (len, 2, 14, 81), (len, 57, 81) の 0/1
+//   np.uint64 : (len, 2, 14, 2), (len, 57, 2)。1 面を u64 2 個の bit に詰める (PackedPlane)
+template <typename F>
+void dispatch_features(const np::ndarray& ndfeatures1, const np::ndarray& ndfeatures2, F f) {
+	const np::dtype dtype = ndfeatures1.get_dtype();
+	if (!np::equivalent(dtype, ndfeatures2.get_dtype())) {
+		PyErr_SetString(PyExc_TypeError, "features1 and features2 must have the same dtype");
+		p::throw_error_already_set();
+	}
+	if (np::equivalent(dtype, np::dtype::get_builtin<float>()))
+		f(FeaturePlaneTag<float[SquareNum]>());
+	else if (np::equivalent(dtype, np::dtype::get_builtin<u8>()))
+		f(FeaturePlaneTag<u8[SquareNum]>());
+	else if (np::equivalent(dtype, np::dtype::get_builtin<u64>()))
+		f(FeaturePlaneTag<PackedPlane>());
 	else {
-		// 白の場合、盤面を180度回転
-		if (position.turn() == White) {
-			to_sq = (u16)SQ99 - to_sq;
+		PyErr_SetString(PyExc_TypeError, "features dtype must be float32, uint8 or uint64");
+		p::throw_error_already_set();
+	}
+}
+
+// decode_* の mirror 引数。左右反転 (1筋 <-> 9筋) した盤面の入力特徴量と指し手を作成する。
+//   None, False : 反転しない
+//   True : 全局面を反転する
+//   np.bool_ か np.uint8 の (len,) の配列 : 0 以外の局面を反転する。局面毎にランダムに反転する場合に使う。
+class MirrorOption {
+public:
+	MirrorOption(const p::object& mirror, const int len) {
+		if (mirror.is_none())
+			return;
+		p::extract<np::ndarray> ndmirror(mirror);
+		if (ndmirror.check()) {
+			const np::ndarray nd = ndmirror();
+			if (!np::equivalent(nd.get_dtype(), np::dtype::get_builtin<bool>()) && !np::equivalent(nd.get_dtype(), np::dtype::get_builtin<u8>())) {
+				PyErr_SetString(PyExc_TypeError, "mirror dtype must be bool or uint8");
+				p::throw_error_already_set();
+			}
+			if (nd.get_nd() != 1 || nd.shape(0) != len) {
+				PyErr_SetString(PyExc_ValueError, "mirror must have the same length as the input");
+				p::throw_error_already_set();
+			}
+			flags_ = reinterpret_cast<const u8 *>(nd.get_data());
 		}
-		const int hand_piece = from_sq - (int)SquareNum;
-		move_direction_label = MOVE_DIRECTION_LABEL_NUM + hand_piece;
+		else {
+			all_ = p::extract<bool>(mirror);
+		}
+	}
+
+	bool operator[](const int i) const {
+		return flags_ != nullptr ? flags_[i] != 0 : all_;
 	}
 
-	*move = 9 * 9 * move_direction_label + to_sq;
+private:
+	bool all_ = false;
+	const u8 *flags_ = nullptr;
+};
+
+// ndarray が C 連続で、期待した形状か確認する。
+// 一致しない場合は TypeError (dtype) か ValueError (形状) を送出する。
+void check_layout(const np::ndarray& nd, const char* name, const std::vector<Py_intptr_t>& shape) {
+	bool ok = nd.get_nd() == (int)shape.size() && (nd.get_flags() & np::ndarray::C_CONTIGUOUS) != 0;
+	for (size_t i = 0; ok && i < shape.size(); i++)
+		ok = nd.shape((int)i) == shape[i];
+	if (!ok) {
+		std::string expected = "(";
+		for (size_t i = 0; i < shape.size(); i++)
+			expected += (i > 0 ? ", " : "") + std::to_string(shape[i]);
+		expected += (shape.size() == 1 ? ",)" : ")");
+		PyErr_SetString(PyExc_ValueError, (std::string(name) + " must be a C-contiguous array of shape " + expected).c_str());
+		p::throw_error_already_set();
+	}
+}
+template <typename T>
+void check_array(const np::ndarray& nd, const char* name, const std::vector<Py_intptr_t>& shape) {
+	if (!np::equivalent(nd.get_dtype(), np::dtype::get_builtin<T>())) {
+		PyErr_SetString(PyExc_TypeError, (std::string(name) + " has an unexpected dtype").c_str());
+		p::throw_error_already_set();
+	}
+	check_layout(nd, name, shape);
+}
+// hcp, hcpe 等の構造体の配列。1 行が sizeof(T) バイトなら、(len, 32) の np.uint8 の配列等も受け付ける。
+template <typename T>
+void check_records(const np::ndarray& nd, const char* name) {
+	if (nd.get_nd() < 1 || (nd.get_flags() & np::ndarray::C_CONTIGUOUS) == 0) {
+		PyErr_SetString(PyExc_ValueError, (std::string(name) + " must be a C-contiguous array").c_str());
+		p::throw_error_already_set();
+	}
+	Py_intptr_t row_size = nd.get_dtype().get_itemsize();
+	for (int i = 1; i < nd.get_nd(); i++)
+		row_size *= nd.shape(i);
+	if (row_size != (Py_intptr_t)sizeof(T)) {
+		PyErr_SetString(PyExc_TypeError, (std::string(name) + " must be an array of " + std::to_string(sizeof(T)) + "-byte records").c_str());
+		p::throw_error_already_set();
+	}
+}
+// (len, 2, 14, W), (len, 57, W)。W は PLANE の要素数
+template <typename PLANE>
+void check_features(const np::ndarray& ndfeatures1, const np::ndarray& ndfeatures2, const int len) {
+	typedef typename PlaneTraits<PLANE>::element_type T;
+	const int width = PlaneTraits<PLANE>::width;
+	check_array<T>(ndfeatures1, "features1", { len, (int)ColorNum, (int)PieceTypeNum - 1, width });
+	check_array<T>(ndfeatures2, "features2", { len, (int)MAX_FEATURES2_NUM, width });
 }
 
 /*
@@ -259,84 +525,846 @@ inline void make_move(const u16 bestMove16, const Position& position, int *move)
 			('dummy', np.uint8),
 		])
 	ndfeatures1, ndfeatures2, ndresult : 変換結果を受け取る。Python側でnp.emptyで事前に領域を確保する。
+		ndfeatures1, ndfeatures2 の形式は dispatch_features を参照。
+	mirror : 左右反転の指定。MirrorOption を参照。
 */
-void decode_with_result(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndresult) {
+void decode_with_result(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndresult, p::object mirror) {
 	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<float>(ndresult, "result", { len });
+	const MirrorOption mirror_option(mirror, len);
 	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
-	float (*features1)[ColorNum][PieceTypeNum-1][SquareNum] = reinterpret_cast<float(*)[ColorNum][PieceTypeNum-1][SquareNum]>(ndfeatures1.get_data());
-	float (*features2)[MAX_FEATURES2_NUM][SquareNum] = reinterpret_cast<float(*)[MAX_FEATURES2_NUM][SquareNum]>(ndfeatures2.get_data());
 	float *result = reinterpret_cast<float *>(ndresult.get_data());
 
-	// set all zero
-	std::fill_n((float*)features1, (int)ColorNum * (PieceTypeNum-1) * (int)SquareNum * len, 0.0f);
-	std::fill_n((float*)features2, MAX_FEATURES2_NUM * (int)SquareNum * len, 0.0f);
+	dispatch_features(ndfeatures1, ndfeatures2, [&](auto tag) {
+		typedef typename decltype(tag)::type PLANE;
+		check_features<PLANE>(ndfeatures1, ndfeatures2, len);
+		PLANE(*features1)[ColorNum][PieceTypeNum - 1] = reinterpret_cast<PLANE(*)[ColorNum][PieceTypeNum - 1]>(ndfeatures1.get_data());
+		PLANE(*features2)[MAX_FEATURES2_NUM] = reinterpret_cast<PLANE(*)[MAX_FEATURES2_NUM]>(ndfeatures2.get_data());
 
-	Position position;
-	for (int i = 0; i < len; i++, hcpe++, features1++, features2++, result++) {
-		position.set(hcpe->hcp, nullptr);
+		ScopedGILRelease release;
+		parallel_for(len, [=](const int begin, const int end) {
+			// set all zero
+			std::memset(features1 + begin, 0, sizeof(*features1) * (end - begin));
+			std::memset(features2 + begin, 0, sizeof(*features2) * (end - begin));
 
-		// input features
-		make_input_features(position, features1, features2);
+			BoardOnlyPosition position;
+			for (int i = begin; i < end; i++) {
+				// input features
+				decode_input_features(hcpe[i].hcp, position, features1 + i, features2 + i, mirror_option[i]);
 
-		// game result
-		make_result(hcpe->gameResult, position, result);
-	}
+				// game result
+				make_result(hcpe[i].gameResult, position, result + i);
+			}
+		});
+	});
 }
 
-void decode_with_move(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndmove) {
+void decode_with_move(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndmove, p::object mirror) {
 	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<int>(ndmove, "move", { len });
+	const MirrorOption mirror_option(mirror, len);
 	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
-	float(*features1)[ColorNum][PieceTypeNum - 1][SquareNum] = reinterpret_cast<float(*)[ColorNum][PieceTypeNum - 1][SquareNum]>(ndfeatures1.get_data());
-	float(*features2)[MAX_FEATURES2_NUM][SquareNum] = reinterpret_cast<float(*)[MAX_FEATURES2_NUM][SquareNum]>(ndfeatures2.get_data());
 	int *move = reinterpret_cast<int *>(ndmove.get_data());
 
-	// set all zero
-	std::fill_n((float*)features1, (int)ColorNum * (PieceTypeNum - 1) * (int)SquareNum * len, 0.0f);
-	std::fill_n((float*)features2, MAX_FEATURES2_NUM * (int)SquareNum * len, 0.0f);
+	dispatch_features(ndfeatures1, ndfeatures2, [&](auto tag) {
+		typedef typename decltype(tag)::type PLANE;
+		check_features<PLANE>(ndfeatures1, ndfeatures2, len);
+		PLANE(*features1)[ColorNum][PieceTypeNum - 1] = reinterpret_cast<PLANE(*)[ColorNum][PieceTypeNum - 1]>(ndfeatures1.get_data());
+		PLANE(*features2)[MAX_FEATURES2_NUM] = reinterpret_cast<PLANE(*)[MAX_FEATURES2_NUM]>(ndfeatures2.get_data());
 
-	Position position;
-	for (int i = 0; i < len; i++, hcpe++, features1++, features2++, move++) {
-		position.set(hcpe->hcp, nullptr);
+		ScopedGILRelease release;
+		parallel_for(len, [=](const int begin, const int end) {
+			// set all zero
+			std::memset(features1 + begin, 0, sizeof(*features1) * (end - begin));
+			std::memset(features2 + begin, 0, sizeof(*features2) * (end - begin));
+
+			BoardOnlyPosition position;
+			for (int i = begin; i < end; i++) {
+				// input features
+				decode_input_features(hcpe[i].hcp, position, features1 + i, features2 + i, mirror_option[i]);
+
+				// move
+				make_move(hcpe[i].bestMove16, position, move + i, mirror_option[i]);
+			}
+		});
+	});
+}
+
+void decode_with_value(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndvalue, np::ndarray ndmove, np::ndarray ndresult, p::object mirror) {
+	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<float>(ndvalue, "value", { len });
+	check_array<int>(ndmove, "move", { len });
+	check_array<float>(ndresult, "result", { len });
+	const MirrorOption mirror_option(mirror, len);
+	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+	float *value = reinterpret_cast<float *>(ndvalue.get_data());
+	int *move = reinterpret_cast<int *>(ndmove.get_data());
+	float *result = reinterpret_cast<float *>(ndresult.get_data());
+
+	dispatch_features(ndfeatures1, ndfeatures2, [&](auto tag) {
+		typedef typename decltype(tag)::type PLANE;
+		check_features<PLANE>(ndfeatures1, ndfeatures2, len);
+		PLANE(*features1)[ColorNum][PieceTypeNum - 1] = reinterpret_cast<PLANE(*)[ColorNum][PieceTypeNum - 1]>(ndfeatures1.get_data());
+		PLANE(*features2)[MAX_FEATURES2_NUM] = reinterpret_cast<PLANE(*)[MAX_FEATURES2_NUM]>(ndfeatures2.get_data());
 
-		// input features
-		make_input_features(position, features1, features2);
+		ScopedGILRelease release;
+		parallel_for(len, [=](const int begin, const int end) {
+			// set all zero
+			std::memset(features1 + begin, 0, sizeof(*features1) * (end - begin));
+			std::memset(features2 + begin, 0, sizeof(*features2) * (end - begin));
 
-		// move
-		make_move(hcpe->bestMove16, position, move);
+			BoardOnlyPosition position;
+			for (int i = begin; i < end; i++) {
+				decode_hcpe_with_value(hcpe[i], position, features1 + i, features2 + i, value + i, move + i, result + i, mirror_option[i]);
+			}
+		});
+	});
+}
+
+/*
+	HuffmanCodedPosの配列から入力特徴量だけを作成する。
+	ndhcp : HuffmanCodedPos = np.dtype([('hcp', np.uint8, 32)]) の配列
+	ndfeatures1, ndfeatures2 : 変換結果を受け取る。Python側でnp.emptyで事前に領域を確保する。
+*/
+void decode_features(np::ndarray ndhcp, np::ndarray ndfeatures1, np::ndarray ndfeatures2, p::object mirror) {
+	const int len = (int)ndhcp.shape(0);
+	check_records<HuffmanCodedPos>(ndhcp, "hcp");
+	const MirrorOption mirror_option(mirror, len);
+	HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
+
+	dispatch_features(ndfeatures1, ndfeatures2, [&](auto tag) {
+		typedef typename decltype(tag)::type PLANE;
+		check_features<PLANE>(ndfeatures1, ndfeatures2, len);
+		PLANE(*features1)[ColorNum][PieceTypeNum - 1] = reinterpret_cast<PLANE(*)[ColorNum][PieceTypeNum - 1]>(ndfeatures1.get_data());
+		PLANE(*features2)[MAX_FEATURES2_NUM] = reinterpret_cast<PLANE(*)[MAX_FEATURES2_NUM]>(ndfeatures2.get_data());
+
+		ScopedGILRelease release;
+		parallel_for(len, [=](const int begin, const int end) {
+			// set all zero
+			std::memset(features1 + begin, 0, sizeof(*features1) * (end - begin));
+			std::memset(features2 + begin, 0, sizeof(*features2) * (end - begin));
+
+			BoardOnlyPosition position;
+			for (int i = begin; i < end; i++) {
+				decode_input_features(hcp[i], position, features1 + i, features2 + i, mirror_option[i]);
+			}
+		});
+	});
+}
+
+/*
+	HuffmanCodedPosWithHistoryAndEvalの配列から、履歴の局面を含む入力ミニバッチに変換する。
+	hcp を 1 回だけ復号して、historyMove16 を順に doMove しながら各局面の入力特徴量を作成する。
+	ndhcphe : Python側で以下の構造体を定義して、その配列を入力する。
+		HuffmanCodedPosWithHistoryAndEval = np.dtype([
+			('hcp', np.uint8, 32),
+			('historyMove16', np.uint16, 7),
+			('eval', np.int16),
+			('bestMove16', np.uint16),
+			('gameResult', np.uint8),
+			('dummy', np.uint8),
+		])
+	ndfeatures1, ndfeatures2 : (len, N, 2, 14, 81), (len, N, 57, 81) の配列。N は 1 以上 8 以下で、直近 N 局面の入力特徴量を作成する。
+		インデックス 0 が現局面 (全履歴手を指した後の局面)、1 が 1 手前の局面。履歴が足りない分は 0 になる。
+		全ての局面を現局面の手番から見た向きで作成する。dtype は dispatch_features を参照 (np.uint64 の場合は最後の次元が 2)。
+	ndvalue, ndmove, ndresult : 現局面の評価値、指し手、勝敗。decode_with_value と同じ。
+	mirror : 左右反転の指定。MirrorOption を参照。
+	hcp が不正な符号か、履歴手に非合法手があるレコードは、そのレコードの入力特徴量を全て 0、move と result を 0 にする。
+*/
+void decode_hcphe_with_value(np::ndarray ndhcphe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndvalue, np::ndarray ndmove, np::ndarray ndresult, p::object mirror) {
+	const int len = (int)ndhcphe.shape(0);
+	const MirrorOption mirror_option(mirror, len);
+	const int history_len = LEN(HuffmanCodedPosWithHistoryAndEval().historyMove16);
+	if (ndfeatures1.get_nd() != 5 || ndfeatures2.get_nd() != 4 || ndfeatures1.shape(1) != ndfeatures2.shape(1) || ndfeatures1.shape(1) < 1 || ndfeatures1.shape(1) > history_len + 1) {
+		PyErr_SetString(PyExc_ValueError, "features1 and features2 must have the shape (len, N, ...) with 1 <= N <= 8");
+		p::throw_error_already_set();
 	}
+	const int num = (int)ndfeatures1.shape(1);
+	check_records<HuffmanCodedPosWithHistoryAndEval>(ndhcphe, "hcphe");
+	check_array<float>(ndvalue, "value", { len });
+	check_array<int>(ndmove, "move", { len });
+	check_array<float>(ndresult, "result", { len });
+	HuffmanCodedPosWithHistoryAndEval *hcphe = reinterpret_cast<HuffmanCodedPosWithHistoryAndEval *>(ndhcphe.get_data());
+	float *value = reinterpret_cast<float *>(ndvalue.get_data());
+	int *move = reinterpret_cast<int *>(ndmove.get_data());
+	float *result = reinterpret_cast<float *>(ndresult.get_data());
+
+	dispatch_features(ndfeatures1, ndfeatures2, [&](auto tag) {
+		typedef typename decltype(tag)::type PLANE;
+		typedef typename PlaneTraits<PLANE>::element_type T;
+		check_array<T>(ndfeatures1, "features1", { len, num, (int)ColorNum, (int)PieceTypeNum - 1, PlaneTraits<PLANE>::width });
+		check_array<T>(ndfeatures2, "features2", { len, num, (int)MAX_FEATURES2_NUM, PlaneTraits<PLANE>::width });
+		PLANE(*features1)[ColorNum][PieceTypeNum - 1] = reinterpret_cast<PLANE(*)[ColorNum][PieceTypeNum - 1]>(ndfeatures1.get_data());
+		PLANE(*features2)[MAX_FEATURES2_NUM] = reinterpret_cast<PLANE(*)[MAX_FEATURES2_NUM]>(ndfeatures2.get_data());
+
+		ScopedGILRelease release;
+		parallel_for(len, [=](const int begin, const int end) {
+			// set all zero
+			std::memset(features1 + (size_t)begin * num, 0, sizeof(*features1) * num * (end - begin));
+			std::memset(features2 + (size_t)begin * num, 0, sizeof(*features2) * num * (end - begin));
+
+			Position position;
+			StateInfo states[history_len];
+			for (int i = begin; i < end; i++) {
+				// eval
+				value[i] = tanh((float)hcphe[i].eval * 0.00067492f);
+
+				bool valid = position.set(hcphe[i].hcp, nullptr);
+				if (valid) {
+					// 履歴手数。0 の手以降は履歴が無い。
+					int n = 0;
+					while (n < history_len && hcphe[i].historyMove16[n] != 0)
+						n++;
+					// 現局面の手番
+					const Color us = (n & 1) ? oppositeColor(position.turn()) : position.turn();
+
+					for (int k = 0; k <= n; k++) {
+						// input features
+						const int h = n - k; // 現局面から何手前か
+						if (h < num)
+							make_input_features(position, us, features1 + (size_t)i * num + h, features2 + (size_t)i * num + h, mirror_option[i]);
+
+						if (k < n) {
+							const Move m = move16toLegalMove(Move(hcphe[i].historyMove16[k]), position);
+							if (!m) {
+								valid = false;
+								break;
+							}
+							position.doMove(m, states[k]);
+						}
+					}
+				}
+				if (!valid) {
+					// 現局面が分からないので、作成済みの履歴の局面も消す。
+					std::memset(features1 + (size_t)i * num, 0, sizeof(*features1) * num);
+					std::memset(features2 + (size_t)i * num, 0, sizeof(*features2) * num);
+					move[i] = 0;
+					result[i] = 0.0f;
+					continue;
+				}
+
+				// move
+				make_move(hcphe[i].bestMove16, position, move + i, mirror_option[i]);
+
+				// game result
+				make_result(hcphe[i].gameResult, position, result + i);
+			}
+		});
+	});
+}
+
+/*
+	decode_features, decode_with_* の入力特徴量を疎な形式で出力する。
+	features1 を 0 で埋めて 1 を書き込む代わりに、1 になる位置の一覧を出力するので、
+	展開は学習側で行う。
+	ndindices : np.int16 の (len, 40) の配列。features1 を (len, 2 * 14 * 81) としたときの 1 になる位置。残りは -1
+	ndhands : np.uint8 の (len, 2, 7) の配列。手番から見た持ち駒の枚数 (features2 と同じく上限で打ち切る)
+	ndcheck : np.uint8 の (len,) の配列。王手なら 1
+	mirror : 左右反転の指定。MirrorOption を参照。
+*/
+void decode_sparse_features(np::ndarray ndhcp, np::ndarray ndindices, np::ndarray ndhands, np::ndarray ndcheck, p::object mirror) {
+	const int len = (int)ndhcp.shape(0);
+	check_records<HuffmanCodedPos>(ndhcp, "hcp");
+	check_array<s16>(ndindices, "indices", { len, MAX_FEATURES1_ACTIVE_NUM });
+	check_array<u8>(ndhands, "hands", { len, (int)ColorNum, (int)HandPieceNum });
+	check_array<u8>(ndcheck, "check", { len });
+	const MirrorOption mirror_option(mirror, len);
+	HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
+	s16(*indices)[MAX_FEATURES1_ACTIVE_NUM] = reinterpret_cast<s16(*)[MAX_FEATURES1_ACTIVE_NUM]>(ndindices.get_data());
+	u8(*hands)[ColorNum][HandPieceNum] = reinterpret_cast<u8(*)[ColorNum][HandPieceNum]>(ndhands.get_data());
+	u8 *check = reinterpret_cast<u8 *>(ndcheck.get_data());
+
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		BoardOnlyPosition position;
+		for (int i = begin; i < end; i++) {
+			decode_sparse_input_features(hcp[i], position, indices + i, hands + i, check + i, mirror_option[i]);
+		}
+	});
+}
+
+void decode_sparse_with_result(np::ndarray ndhcpe, np::ndarray ndindices, np::ndarray ndhands, np::ndarray ndcheck, np::ndarray ndresult, p::object mirror) {
+	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<s16>(ndindices, "indices", { len, MAX_FEATURES1_ACTIVE_NUM });
+	check_array<u8>(ndhands, "hands", { len, (int)ColorNum, (int)HandPieceNum });
+	check_array<u8>(ndcheck, "check", { len });
+	check_array<float>(ndresult, "result", { len });
+	const MirrorOption mirror_option(mirror, len);
+	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+	s16(*indices)[MAX_FEATURES1_ACTIVE_NUM] = reinterpret_cast<s16(*)[MAX_FEATURES1_ACTIVE_NUM]>(ndindices.get_data());
+	u8(*hands)[ColorNum][HandPieceNum] = reinterpret_cast<u8(*)[ColorNum][HandPieceNum]>(ndhands.get_data());
+	u8 *check = reinterpret_cast<u8 *>(ndcheck.get_data());
+	float *result = reinterpret_cast<float *>(ndresult.get_data());
+
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		BoardOnlyPosition position;
+		for (int i = begin; i < end; i++) {
+			// input features
+			decode_sparse_input_features(hcpe[i].hcp, position, indices + i, hands + i, check + i, mirror_option[i]);
+
+			// game result
+			make_result(hcpe[i].gameResult, position, result + i);
+		}
+	});
+}
+
+void decode_sparse_with_move(np::ndarray ndhcpe, np::ndarray ndindices, np::ndarray ndhands, np::ndarray ndcheck, np::ndarray ndmove, p::object mirror) {
+	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<s16>(ndindices, "indices", { len, MAX_FEATURES1_ACTIVE_NUM });
+	check_array<u8>(ndhands, "hands", { len, (int)ColorNum, (int)HandPieceNum });
+	check_array<u8>(ndcheck, "check", { len });
+	check_array<int>(ndmove, "move", { len });
+	const MirrorOption mirror_option(mirror, len);
+	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+	s16(*indices)[MAX_FEATURES1_ACTIVE_NUM] = reinterpret_cast<s16(*)[MAX_FEATURES1_ACTIVE_NUM]>(ndindices.get_data());
+	u8(*hands)[ColorNum][HandPieceNum] = reinterpret_cast<u8(*)[ColorNum][HandPieceNum]>(ndhands.get_data());
+	u8 *check = reinterpret_cast<u8 *>(ndcheck.get_data());
+	int *move = reinterpret_cast<int *>(ndmove.get_data());
+
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		BoardOnlyPosition position;
+		for (int i = begin; i < end; i++) {
+			// input features
+			decode_sparse_input_features(hcpe[i].hcp, position, indices + i, hands + i, check + i, mirror_option[i]);
+
+			// move
+			make_move(hcpe[i].bestMove16, position, move + i, mirror_option[i]);
+		}
+	});
 }
 
-void decode_with_value(np::ndarray ndhcpe, np::ndarray ndfeatures1, np::ndarray ndfeatures2, np::ndarray ndvalue, np::ndarray ndmove, np::ndarray ndresult) {
+void decode_sparse_with_value(np::ndarray ndhcpe, np::ndarray ndindices, np::ndarray ndhands, np::ndarray ndcheck, np::ndarray ndvalue, np::ndarray ndmove, np::ndarray ndresult, p::object mirror) {
 	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	check_array<s16>(ndindices, "indices", { len, MAX_FEATURES1_ACTIVE_NUM });
+	check_array<u8>(ndhands, "hands", { len, (int)ColorNum, (int)HandPieceNum });
+	check_array<u8>(ndcheck, "check", { len });
+	check_array<float>(ndvalue, "value", { len });
+	check_array<int>(ndmove, "move", { len });
+	check_array<float>(ndresult, "result", { len });
+	const MirrorOption mirror_option(mirror, len);
 	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
-	float(*features1)[ColorNum][PieceTypeNum - 1][SquareNum] = reinterpret_cast<float(*)[ColorNum][PieceTypeNum - 1][SquareNum]>(ndfeatures1.get_data());
-	float(*features2)[MAX_FEATURES2_NUM][SquareNum] = reinterpret_cast<float(*)[MAX_FEATURES2_NUM][SquareNum]>(ndfeatures2.get_data());
+	s16(*indices)[MAX_FEATURES1_ACTIVE_NUM] = reinterpret_cast<s16(*)[MAX_FEATURES1_ACTIVE_NUM]>(ndindices.get_data());
+	u8(*hands)[ColorNum][HandPieceNum] = reinterpret_cast<u8(*)[ColorNum][HandPieceNum]>(ndhands.get_data());
+	u8 *check = reinterpret_cast<u8 *>(ndcheck.get_data());
 	float *value = reinterpret_cast<float *>(ndvalue.get_data());
 	int *move = reinterpret_cast<int *>(ndmove.get_data());
 	float *result = reinterpret_cast<float *>(ndresult.get_data());
 
-	// set all zero
-	std::fill_n((float*)features1, (int)ColorNum * (PieceTypeNum - 1) * (int)SquareNum * len, 0.0f);
-	std::fill_n((float*)features2, MAX_FEATURES2_NUM * (int)SquareNum * len, 0.0f);
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		BoardOnlyPosition position;
+		for (int i = begin; i < end; i++) {
+			// input features
+			decode_sparse_input_features(hcpe[i].hcp, position, indices + i, hands + i, check + i, mirror_option[i]);
 
-	Position position;
-	for (int i = 0; i < len; i++, hcpe++, features1++, features2++, value++, move++, result++) {
-		position.set(hcpe->hcp, nullptr);
+			// eval
+			value[i] = tanh((float)hcpe[i].eval * 0.00067492f);
+
+			// move
+			make_move(hcpe[i].bestMove16, position, move + i, mirror_option[i]);
+
+			// game result
+			make_result(hcpe[i].gameResult, position, result + i);
+		}
+	});
+}
+
+/*
+	HuffmanCodedPosAndEvalの配列から、各局面の合法手のマスクを作成する。
+	合法手は MoveList<Legal> で生成し、make_move と同じラベルの位置を 1 にする。
+	ndmask : 以下のどちらか。Python側でnp.emptyで事前に領域を確保する。
+		np.uint8 の (len, 9 * 9 * (MOVE_DIRECTION_LABEL_NUM + 7)) の配列
+		np.uint64 の (len, 上の要素数を 64 で割って切り上げた数) の配列。ラベル l は [l / 64] の l % 64 bit 目
+	mirror : 左右反転の指定。MirrorOption を参照。
+*/
+void decode_legal_mask(np::ndarray ndhcpe, np::ndarray ndmask, p::object mirror) {
+	const int len = (int)ndhcpe.shape(0);
+	check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+	const bool packed = np::equivalent(ndmask.get_dtype(), np::dtype::get_builtin<u64>());
+	if (packed)
+		check_array<u64>(ndmask, "mask", { len, MOVE_LABEL_WORD_NUM });
+	else
+		check_array<u8>(ndmask, "mask", { len, MOVE_LABEL_NUM });
+	const MirrorOption mirror_option(mirror, len);
+	const HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+	u8(*mask)[MOVE_LABEL_NUM] = reinterpret_cast<u8(*)[MOVE_LABEL_NUM]>(ndmask.get_data());
+	u64(*packed_mask)[MOVE_LABEL_WORD_NUM] = reinterpret_cast<u64(*)[MOVE_LABEL_WORD_NUM]>(ndmask.get_data());
+
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		// set all zero
+		if (packed)
+			std::memset(packed_mask + begin, 0, sizeof(*packed_mask) * (end - begin));
+		else
+			std::memset(mask + begin, 0, sizeof(*mask) * (end - begin));
+
+		Position position;
+		for (int i = begin; i < end; i++) {
+			if (!position.set(hcpe[i].hcp, nullptr))
+				continue;
+			for (MoveList<Legal> ml(position); !ml.end(); ++ml) {
+				int label;
+				make_move((u16)ml.move().value(), position, &label, mirror_option[i]);
+				if (packed)
+					packed_mask[i][label >> 6] |= UINT64_C(1) << (label & 63);
+				else
+					mask[i][label] = 1;
+			}
+		}
+	});
+}
+
+/*
+	HuffmanCodedPosの配列と指し手から、make_move と同じ指し手のラベルを作成する。
+	ndhcp : HuffmanCodedPos = np.dtype([('hcp', np.uint8, 32)]) の配列
+	ndmove16 : np.uint16 の (len,) の配列。bestMove16 と同じ形式
+	ndlabels : 変換結果を受け取る。np.int32 の (len,) の配列。不正な局面、指し手は -1 になる。
+	mirror : 左右反転の指定。MirrorOption を参照。
+*/
+void labels_from_move16(np::ndarray ndhcp, np::ndarray ndmove16, np::ndarray ndlabels, p::object mirror) {
+	const int len = (int)ndhcp.shape(0);
+	check_records<HuffmanCodedPos>(ndhcp, "hcp");
+	check_array<u16>(ndmove16, "move16", { len });
+	check_array<int>(ndlabels, "labels", { len });
+	const MirrorOption mirror_option(mirror, len);
+	const HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
+	const u16 *move16 = reinterpret_cast<u16 *>(ndmove16.get_data());
+	int *labels = reinterpret_cast<int *>(ndlabels.get_data());
 
-		// input features
-		make_input_features(position, features1, features2);
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		BoardOnlyPosition position;
+		for (int i = begin; i < end; i++) {
+			if (!position.set(hcp[i])) {
+				labels[i] = -1;
+				continue;
+			}
+			make_move(move16[i], position, labels + i, mirror_option[i]);
+		}
+	});
+}
+
+/*
+	labels_from_move16 の逆変換。方策の出力を指し手に戻す場合に使う。
+	局面の合法手のうち、make_move でラベルが一致する最初の手を返す。一致する合法手が無い場合は 0 になる。
+	ndhcp : HuffmanCodedPos = np.dtype([('hcp', np.uint8, 32)]) の配列
+	ndlabels : np.int32 の (len,) の配列
+	ndmove16 : 変換結果を受け取る。np.uint16 の (len,) の配列
+	mirror : 左右反転の指定。ラベルを作成した時と同じ指定にする。
+*/
+void move16_from_label(np::ndarray ndhcp, np::ndarray ndlabels, np::ndarray ndmove16, p::object mirror) {
+	const int len = (int)ndhcp.shape(0);
+	check_records<HuffmanCodedPos>(ndhcp, "hcp");
+	check_array<int>(ndlabels, "labels", { len });
+	check_array<u16>(ndmove16, "move16", { len });
+	const MirrorOption mirror_option(mirror, len);
+	const HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
+	const int *labels = reinterpret_cast<int *>(ndlabels.get_data());
+	u16 *move16 = reinterpret_cast<u16 *>(ndmove16.get_data());
 
-		// eval
-		*value = tanh((float)hcpe->eval * 0.00067492f);
+	ScopedGILRelease release;
+	parallel_for(len, [=](const int begin, const int end) {
+		Position position;
+		for (int i = begin; i < end; i++) {
+			move16[i] = 0;
+			if (!position.set(hcp[i], nullptr))
+				continue;
+			for (MoveList<Legal> ml(position); !ml.end(); ++ml) {
+				const u16 m16 = (u16)ml.move().value();
+				int label;
+				make_move(m16, position, &label, mirror_option[i]);
+				if (label == labels[i]) {
+					move16[i] = m16;
+					break;
+				}
+			}
+		}
+	});
+}
 
-		// move
-		make_move(hcpe->bestMove16, position, move);
+/*
+	HuffmanCodedPosの配列から局面のハッシュ値を計算する。Position::getKey()と同じ値になる。
+	ndhcp : HuffmanCodedPos = np.dtype([('hcp', np.uint8, 32)]) の配列
+	ndkeys : 変換結果を受け取る。np.uint64 の配列。不正な符号の局面は 0 になる。
+*/
+void hcp_keys(np::ndarray ndhcp, np::ndarray ndkeys) {
+	const int len = (int)ndhcp.shape(0);
+	check_records<HuffmanCodedPos>(ndhcp, "hcp");
+	check_array<u64>(ndkeys, "keys", { len });
+	const HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
+	Key *keys = reinterpret_cast<Key *>(ndkeys.get_data());
 
-		// game result
-		make_result(hcpe->gameResult, position, result);
+	for (int i = 0; i < len; i++, hcp++, keys++) {
+		if (!Position::getKey(*hcp, *keys))
+			*keys = 0;
 	}
 }
 
+// 読み込み専用でファイルをメモリマップする。
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path) {
+		close();
+#ifdef _WIN32
+		file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file_, &size)) {
+			close();
+			return false;
+		}
+		size_ = (size_t)size.QuadPart;
+		if (size_ == 0)
+			return true;
+		mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping_ == nullptr) {
+			close();
+			return false;
+		}
+		data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd_ = ::open(path.c_str(), O_RDONLY);
+		if (fd_ < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd_, &st) != 0) {
+			close();
+			return false;
+		}
+		size_ = (size_t)st.st_size;
+		if (size_ == 0)
+			return true;
+		data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+		if (data_ == MAP_FAILED)
+			data_ = nullptr;
+		else
+			madvise(data_, size_, MADV_RANDOM);
+#endif
+		if (data_ == nullptr) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data_ != nullptr)
+			UnmapViewOfFile(data_);
+		if (mapping_ != nullptr)
+			CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(file_);
+		mapping_ = nullptr;
+		file_ = INVALID_HANDLE_VALUE;
+#else
+		if (data_ != nullptr)
+			munmap(data_, size_);
+		if (fd_ >= 0)
+			::close(fd_);
+		fd_ = -1;
+#endif
+		data_ = nullptr;
+		size_ = 0;
+	}
+
+	const void* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+#ifdef _WIN32
+	HANDLE file_ = INVALID_HANDLE_VALUE;
+	HANDLE mapping_ = nullptr;
+#else
+	int fd_ = -1;
+#endif
+	void* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+// decode_with_value と同じ形式のミニバッチの領域。GIL を取得した状態で作成、破棄すること。
+struct Minibatch {
+	explicit Minibatch(const int batch_size)
+		: ndfeatures1(np::empty(p::make_tuple(batch_size, (int)ColorNum, (int)PieceTypeNum - 1, (int)SquareNum), np::dtype::get_builtin<float>())),
+		ndfeatures2(np::empty(p::make_tuple(batch_size, (int)MAX_FEATURES2_NUM, (int)SquareNum), np::dtype::get_builtin<float>())),
+		ndvalue(np::empty(p::make_tuple(batch_size), np::dtype::get_builtin<float>())),
+		ndmove(np::empty(p::make_tuple(batch_size), np::dtype::get_builtin<int>())),
+		ndresult(np::empty(p::make_tuple(batch_size), np::dtype::get_builtin<float>())),
+		features1(reinterpret_cast<float(*)[ColorNum][PieceTypeNum - 1][SquareNum]>(ndfeatures1.get_data())),
+		features2(reinterpret_cast<float(*)[MAX_FEATURES2_NUM][SquareNum]>(ndfeatures2.get_data())),
+		value(reinterpret_cast<float *>(ndvalue.get_data())),
+		move(reinterpret_cast<int *>(ndmove.get_data())),
+		result(reinterpret_cast<float *>(ndresult.get_data())) {}
+
+	// 先頭 len 局面の (features1, features2, value, move, result) を返す。
+	p::tuple to_tuple(const int len) const {
+		if (len == ndvalue.shape(0))
+			return p::make_tuple(ndfeatures1, ndfeatures2, ndvalue, ndmove, ndresult);
+		const p::slice s(0, len);
+		return p::make_tuple(ndfeatures1[s], ndfeatures2[s], ndvalue[s], ndmove[s], ndresult[s]);
+	}
+
+	np::ndarray ndfeatures1;
+	np::ndarray ndfeatures2;
+	np::ndarray ndvalue;
+	np::ndarray ndmove;
+	np::ndarray ndresult;
+	float(*features1)[ColorNum][PieceTypeNum - 1][SquareNum];
+	float(*features2)[MAX_FEATURES2_NUM][SquareNum];
+	float *value;
+	int *move;
+	float *result;
+};
+
+/*
+	hcpe ファイルを読み込んで、decode_with_value と同じ形式のミニバッチをバックグラウンドで作成する。
+	files : hcpe ファイルのパスのリスト。メモリマップして読み込む。
+	batch_size : ミニバッチの局面数
+	num_workers : ミニバッチを作成するスレッド数
+	queue_size : 事前に確保するミニバッチの数。num_workers + 1 以上にすると、ワーカーが待たずに済む。
+	shuffle : True なら、エポック毎に全ファイルの局面の順番をシャッフルする。
+	          順番はシードとエポックから決まる鍵付きの全単射 (FeistelPermutation) で計算するので、順番の配列は持たない。
+	seed : シャッフルの乱数の種
+	mirror : True なら、局面毎に 1/2 の確率で左右反転する。
+
+	next() は (features1, features2, value, move, result) のタプルを返す。
+	返した配列は次に next() を呼んだ時点でワーカーが上書きするので、保持する場合はコピーすること。
+*/
+class HcpeLoader {
+public:
+	HcpeLoader(p::list files, const int batch_size, const int num_workers = 1, const int queue_size = 4, const bool shuffle = true, const unsigned int seed = 0, const bool mirror = false)
+		: batch_size_(batch_size), shuffle_(shuffle), mirror_(mirror), seed_(seed), mt_(seed)
+	{
+		if (batch_size <= 0 || num_workers <= 0 || queue_size < 2) {
+			PyErr_SetString(PyExc_ValueError, "batch_size and num_workers must be positive, queue_size must be at least 2");
+			p::throw_error_already_set();
+		}
+
+		const int file_num = (int)p::len(files);
+		files_.reserve(file_num);
+		offsets_.push_back(0);
+		for (int i = 0; i < file_num; i++) {
+			const std::string path = p::extract<std::string>(files[i]);
+			files_.emplace_back(new MappedFile());
+			if (!files_.back()->open(path)) {
+				PyErr_SetString(PyExc_IOError, ("cannot open " + path).c_str());
+				p::throw_error_already_set();
+			}
+			offsets_.push_back(offsets_.back() + files_.back()->size() / sizeof(HuffmanCodedPosAndEval));
+		}
+		if (offsets_.back() == 0) {
+			PyErr_SetString(PyExc_ValueError, "no records");
+			p::throw_error_already_set();
+		}
+		slots_.reserve(queue_size);
+		for (int i = 0; i < queue_size; i++)
+			slots_.emplace_back(new Slot(batch_size));
+
+		workers_.reserve(num_workers);
+		for (int i = 0; i < num_workers; i++)
+			workers_.emplace_back(&HcpeLoader::worker, this);
+	}
+
+	~HcpeLoader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		free_cond_.notify_all();
+		for (auto& th : workers_)
+			th.join();
+	}
+
+	// 次のミニバッチを返す。前回返したミニバッチの領域はワーカーに返却する。
+	p::tuple next() {
+		Slot* slot;
+		{
+			ScopedGILRelease release;
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (consumed_ > 0) {
+				slots_[(consumed_ - 1) % slots_.size()]->state = Slot::Free;
+				free_cond_.notify_all();
+			}
+			slot = slots_[consumed_ % slots_.size()].get();
+			ready_cond_.wait(lock, [slot] { return slot->state == Slot::Ready; });
+			consumed_++;
+		}
+		return slot->to_tuple(batch_size_);
+	}
+
+	// 全ファイルの局面数
+	u64 size() const { return offsets_.back(); }
+
+private:
+	struct Slot : public Minibatch {
+		enum State { Free, Filling, Ready };
+
+		explicit Slot(const int batch_size) : Minibatch(batch_size), indices(batch_size), mirror(batch_size) {}
+
+		u64 first = 0; // 先頭の局面の通し番号。エポックを跨いで数える。
+		std::vector<u64> indices;
+		std::vector<u8> mirror;
+		State state = Free;
+	};
+
+	const HuffmanCodedPosAndEval& record(const u64 index) const {
+		const size_t file = std::upper_bound(offsets_.begin(), offsets_.end(), index) - offsets_.begin() - 1;
+		return reinterpret_cast<const HuffmanCodedPosAndEval*>(files_[file]->data())[index - offsets_[file]];
+	}
+
+	// mutex_ をロックした状態で呼ぶこと。通し番号の範囲と左右反転だけを決める。
+	void draw_indices(Slot& slot) {
+		slot.first = drawn_;
+		drawn_ += batch_size_;
+		if (mirror_) {
+			for (size_t i = 0; i < slot.mirror.size(); i += 64) {
+				const u64 bits = mt_();
+				for (size_t j = i; j < std::min(i + 64, slot.mirror.size()); j++)
+					slot.mirror[j] = (bits >> (j - i)) & 1;
+			}
+		}
+	}
+
+	void worker() {
+		BoardOnlyPosition position;
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			free_cond_.wait(lock, [this] { return stop_ || slots_[filled_ % slots_.size()]->state == Slot::Free; });
+			if (stop_)
+				return;
+			Slot& slot = *slots_[filled_++ % slots_.size()];
+			slot.state = Slot::Filling;
+			draw_indices(slot);
+			lock.unlock();
+
+			// 通し番号を局面の番号に変換する。エポック毎の全単射はロックの外で作る。
+			const u64 n = size();
+			u64 epoch = UINT64_MAX;
+			std::unique_ptr<FeistelPermutation> perm;
+			for (int i = 0; i < batch_size_; i++) {
+				const u64 serial = slot.first + i;
+				if (shuffle_ && serial / n != epoch) {
+					epoch = serial / n;
+					ShuffleRandom random(seed_, HcpeLoaderStream, epoch);
+					perm.reset(new FeistelPermutation(n, random));
+				}
+				slot.indices[i] = (shuffle_ ? (*perm)(serial % n) : serial % n);
+			}
+
+			// set all zero
+			std::memset(slot.features1, 0, sizeof(*slot.features1) * batch_size_);
+			std::memset(slot.features2, 0, sizeof(*slot.features2) * batch_size_);
+			for (int i = 0; i < batch_size_; i++) {
+				decode_hcpe_with_value(record(slot.indices[i]), position, slot.features1 + i, slot.features2 + i, slot.value + i, slot.move + i, slot.result + i, slot.mirror[i] != 0);
+			}
+
+			lock.lock();
+			slot.state = Slot::Ready;
+			ready_cond_.notify_all();
+		}
+	}
+
+	const int batch_size_;
+	const bool shuffle_;
+	const bool mirror_;
+	const u64 seed_;
+	std::vector<std::unique_ptr<MappedFile> > files_;
+	std::vector<u64> offsets_; // files_[i] の先頭の局面の通し番号
+	u64 drawn_ = 0; // ミニバッチに割り当てた局面の数。エポックを跨いで数える。
+	std::mt19937_64 mt_; // 左右反転の乱数
+	static const u32 HcpeLoaderStream = 4; // ShuffleRandom の用途。shuffle.hpp のツール、ShardShuffleReader と重ならない値にする。
+
+	std::vector<std::unique_ptr<Slot> > slots_;
+	u64 filled_ = 0; // ワーカーが作成を始めたミニバッチの数
+	u64 consumed_ = 0; // next() で返したミニバッチの数
+	bool stop_ = false;
+	std::mutex mutex_;
+	std::condition_variable free_cond_;
+	std::condition_variable ready_cond_;
+	std::vector<std::thread> workers_;
+};
+
+/*
+	decode_with_value を繰り返し呼ぶ場合に使う。
+	max_batch_size : 1 回に変換する局面数の上限。出力の領域を事前に確保する。
+	num_threads : 変換に使うスレッド数。スレッドと BoardOnlyPosition は呼び出し間で使い回す。
+
+	decode_with_value(hcpe, mirror=None) は (features1, features2, value, move, result) のタプルを返す。
+	返した配列は Decoder の領域のビューなので、次の呼び出しで上書きされる。
+	同じ Decoder を複数の Python スレッドから同時に使わないこと。
+	hcpe の dtype、形状、連続性は呼び出し毎に確認するが、出力の領域は確認済みのものを使う。
+	last_time, total_time : 直前の呼び出し、全ての呼び出しの変換にかかった秒数
+*/
+class Decoder {
+public:
+	Decoder(const int max_batch_size, const int num_threads = 1)
+		: batch_(check_max_batch_size(max_batch_size)), pool_(num_threads), positions_(pool_.num_threads()) {}
+
+	p::tuple decode_with_value(np::ndarray ndhcpe, p::object mirror) {
+		const auto start = std::chrono::steady_clock::now();
+		check_records<HuffmanCodedPosAndEval>(ndhcpe, "hcpe");
+		const int len = (int)ndhcpe.shape(0);
+		if (len > max_batch_size()) {
+			PyErr_SetString(PyExc_ValueError, "hcpe is longer than max_batch_size");
+			p::throw_error_already_set();
+		}
+		const MirrorOption mirror_option(mirror, len);
+		const HuffmanCodedPosAndEval *hcpe = reinterpret_cast<const HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+
+		{
+			ScopedGILRelease release;
+			pool_.run(len, [&](const int begin, const int end, const int thread_id) {
+				// set all zero
+				std::memset(batch_.features1 + begin, 0, sizeof(*batch_.features1) * (end - begin));
+				std::memset(batch_.features2 + begin, 0, sizeof(*batch_.features2) * (end - begin));
+
+				BoardOnlyPosition& position = positions_[thread_id];
+				for (int i = begin; i < end; i++) {
+					decode_hcpe_with_value(hcpe[i], position, batch_.features1 + i, batch_.features2 + i, batch_.value + i, batch_.move + i, batch_.result + i, mirror_option[i]);
+				}
+			});
+		}
+
+		last_time_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		total_time_ += last_time_;
+		return batch_.to_tuple(len);
+	}
+
+	int max_batch_size() const { return (int)batch_.ndvalue.shape(0); }
+	int num_threads() const { return pool_.num_threads(); }
+	double last_time() const { return last_time_; }
+	double total_time() const { return total_time_; }
+
+private:
+	static int check_max_batch_size(const int max_batch_size) {
+		if (max_batch_size <= 0) {
+			PyErr_SetString(PyExc_ValueError, "max_batch_size must be positive");
+			p::throw_error_already_set();
+		}
+		return max_batch_size;
+	}
+
+	Minibatch batch_;
+	WorkerPool pool_;
+	std::vector<BoardOnlyPosition> positions_; // スレッド毎の作業領域
+	double last_time_ = 0.0;
+	double total_time_ = 0.0;
+};
+
 void print_sfen_from_hcp(np::ndarray ndhcp) {
 	const int len = (int)ndhcp.shape(0);
 	HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
@@ -380,37 +1408,304 @@ void print_sfen_from_hcphe(np::ndarray ndhcphe) {
 	}
 }
 
-bool operator<(const HuffmanCodedPos& l, const HuffmanCodedPos& r) {
-	for (int i = 0; i < 32; i++) {
-		if (l.data[i] < r.data[i]) {
-			return true;
+// レコードの先頭の HuffmanCodedPos が同じものを重複として検出する。
+// 局面数の 4/3 倍以上の 2 のべき乗の大きさのオープンアドレス法のハッシュ表を使い、並列に登録する。
+// ハッシュ表の要素には、同じ局面の最小のインデックス + 1 を CAS で書き込むので、結果はスレッド数に依らない。
+class DuplicateDetector {
+public:
+	DuplicateDetector(const u8 *records, const size_t record_size, const int len)
+		: records_(records), record_size_(record_size), len_(len)
+	{
+		while (capacity_ < (u64)len * 4 / 3 + 1)
+			capacity_ <<= 1;
+		table_.reset(new std::atomic<u32>[capacity_]);
+	}
+
+	// first[i] : i が同じ局面の最初の出現なら true
+	// group[i] : 同じ局面の最初の出現のインデックス
+	// 戻り値 : 重複を除いた局面数
+	s64 run(bool *first, s64 *group) {
+		const u64 capacity = capacity_;
+		std::atomic<u32> *table = table_.get();
+		const int block = 1 << 16;
+		parallel_for((int)((capacity + block - 1) / block), [=](const int begin, const int end) {
+			for (u64 i = (u64)begin * block; i < std::min<u64>((u64)end * block, capacity); i++)
+				table[i].store(0, std::memory_order_relaxed);
+		});
+
+		// 登録
+		parallel_for(len_, [this](const int begin, const int end) {
+			for (int i = begin; i < end; i++)
+				insert(i);
+		});
+
+		// 同じ局面の最小のインデックスを引く
+		std::atomic<s64> unique(0);
+		parallel_for(len_, [&](const int begin, const int end) {
+			s64 count = 0;
+			for (int i = begin; i < end; i++) {
+				const s64 representative = find(i);
+				first[i] = representative == i;
+				group[i] = representative;
+				count += first[i];
+			}
+			unique += count;
+		});
+		return unique;
+	}
+
+private:
+	const HuffmanCodedPos& hcp(const u32 index) const {
+		return *reinterpret_cast<const HuffmanCodedPos *>(records_ + record_size_ * index);
+	}
+
+	u64 hash(const HuffmanCodedPos& hcp) const {
+		u64 words[4];
+		std::memcpy(words, hcp.data, sizeof(words));
+		u64 h = 0;
+		for (const u64 w : words) {
+			h ^= w * UINT64_C(0x87c37b91114253d5);
+			h = ((h << 31) | (h >> 33)) * UINT64_C(0x4cf5ad432745937f);
+		}
+		h ^= h >> 33;
+		h *= UINT64_C(0xff51afd7ed558ccd);
+		h ^= h >> 33;
+		return h;
+	}
+
+	bool equal(const u32 l, const u32 r) const {
+		return std::memcmp(hcp(l).data, hcp(r).data, sizeof(HuffmanCodedPos)) == 0;
+	}
+
+	void insert(const u32 index) {
+		const u64 mask = capacity_ - 1;
+		for (u64 pos = hash(hcp(index)) & mask; ; pos = (pos + 1) & mask) {
+			std::atomic<u32>& slot = table_[pos];
+			u32 value = slot.load(std::memory_order_acquire);
+			while (true) {
+				if (value == 0) {
+					if (slot.compare_exchange_weak(value, index + 1, std::memory_order_acq_rel))
+						return;
+					continue;
+				}
+				if (!equal(value - 1, index))
+					break;
+				// 同じ局面なら、小さいインデックスを残す。
+				if (value - 1 <= index || slot.compare_exchange_weak(value, index + 1, std::memory_order_acq_rel))
+					return;
+			}
+		}
+	}
+
+	u32 find(const u32 index) const {
+		const u64 mask = capacity_ - 1;
+		for (u64 pos = hash(hcp(index)) & mask; ; pos = (pos + 1) & mask) {
+			const u32 value = table_[pos].load(std::memory_order_relaxed);
+			if (equal(value - 1, index))
+				return value - 1;
 		}
 	}
-	return false;
+
+	const u8 *records_;
+	const size_t record_size_;
+	const int len_;
+	u64 capacity_ = 1;
+	std::unique_ptr<std::atomic<u32>[]> table_;
+};
+
+// 先頭が HuffmanCodedPos のレコード (hcp, hcpe, hcphe) の配列の 1 レコードのバイト数
+size_t check_hcp_records(const np::ndarray& nd, const char* name) {
+	if (nd.get_nd() < 1 || (nd.get_flags() & np::ndarray::C_CONTIGUOUS) == 0) {
+		PyErr_SetString(PyExc_ValueError, (std::string(name) + " must be a C-contiguous array").c_str());
+		p::throw_error_already_set();
+	}
+	Py_intptr_t row_size = nd.get_dtype().get_itemsize();
+	for (int i = 1; i < nd.get_nd(); i++)
+		row_size *= nd.shape(i);
+	if (row_size < (Py_intptr_t)sizeof(HuffmanCodedPos)) {
+		PyErr_SetString(PyExc_TypeError, (std::string(name) + " must be an array of records starting with a 32-byte HuffmanCodedPos").c_str());
+		p::throw_error_already_set();
+	}
+	return (size_t)row_size;
+}
+
+/*
+	局面の重複を検出する。
+	ndrecords : hcp, hcpe, hcphe の配列。先頭の hcp が同じレコードを重複とする。
+	ndfirst : 変換結果を受け取る。np.bool_ の (len,) の配列。同じ局面の最初の出現なら True
+	ndgroup : 変換結果を受け取る。np.int64 の (len,) の配列。同じ局面の最初の出現のインデックス
+	戻り値 : 重複を除いた局面数
+*/
+s64 find_duplicates(np::ndarray ndrecords, np::ndarray ndfirst, np::ndarray ndgroup) {
+	const int len = (int)ndrecords.shape(0);
+	const size_t record_size = check_hcp_records(ndrecords, "records");
+	check_array<bool>(ndfirst, "first", { len });
+	check_array<s64>(ndgroup, "group", { len });
+	const u8 *records = reinterpret_cast<u8 *>(ndrecords.get_data());
+	bool *first = reinterpret_cast<bool *>(ndfirst.get_data());
+	s64 *group = reinterpret_cast<s64 *>(ndgroup.get_data());
+
+	ScopedGILRelease release;
+	DuplicateDetector detector(records, record_size, len);
+	return detector.run(first, group);
 }
+
 void check_duplicates(np::ndarray ndhcpe) {
 	const int len = (int)ndhcpe.shape(0);
 	std::cout << "len:" << len << std::endl;
-	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
+	const size_t record_size = check_hcp_records(ndhcpe, "hcpe");
+	const u8 *records = reinterpret_cast<u8 *>(ndhcpe.get_data());
 
-	std::set<HuffmanCodedPos> set;
-	int dup_cnt = 0;
-	for (int i = 0; i < len; i++, hcpe++) {
-		if (set.find(hcpe->hcp) == set.end()) {
-			set.insert(hcpe->hcp);
-		}
-		else {
-			dup_cnt++;
-		}
+	std::unique_ptr<bool[]> first(new bool[len]);
+	std::unique_ptr<s64[]> group(new s64[len]);
+	s64 unique;
+	{
+		ScopedGILRelease release;
+		DuplicateDetector detector(records, record_size, len);
+		unique = detector.run(first.get(), group.get());
 	}
-	std::cout << "dup_cnt:" << dup_cnt << std::endl;
+	std::cout << "dup_cnt:" << len - unique << std::endl;
 }
 
 void sfen_to_hcp(const char* sfen, np::ndarray ndhcp) {
 	HuffmanCodedPos *hcp = reinterpret_cast<HuffmanCodedPos *>(ndhcp.get_data());
 	Position position;
 	position.set(sfen, nullptr);
-	*hcp = position.toHuffmanCodedPos();
+	const Position* positions[] = { &position };
+	toHuffmanCodedPosBatch(positions, 1, hcp);
+}
+
+/*
+	局面を SFEN に変換して、1 行 1 局面の bytes で返す。
+	各行は Position::toSFEN() と同じ "sfen ... 1" の形式で、改行は '\n'。
+	ndrecords : hcp, hcpe, hcphe の配列。先頭の hcp を変換する。
+*/
+p::object hcp_to_sfen_bytes(np::ndarray ndrecords) {
+	const int len = (int)ndrecords.shape(0);
+	const size_t record_size = check_hcp_records(ndrecords, "records");
+	const u8 *records = reinterpret_cast<u8 *>(ndrecords.get_data());
+
+	// ブロック毎に文字数を数えてから、出力先の bytes に直接書き込む。
+	const int block = 4096;
+	const int num_blocks = (len + block - 1) / block;
+	std::vector<s64> offsets(num_blocks + 1);
+	std::atomic<int> invalid(len);
+	{
+		ScopedGILRelease release;
+		parallel_for(num_blocks, [&](const int begin, const int end) {
+			char buf[MaxSFENLength];
+			for (int b = begin; b < end; b++) {
+				s64 size = 0;
+				for (int i = b * block; i < std::min(len, (b + 1) * block); i++) {
+					const int n = huffmanCodedPosToSFEN(*reinterpret_cast<const HuffmanCodedPos *>(records + record_size * i), buf);
+					if (n == 0) {
+						int expected = invalid.load();
+						while (i < expected && !invalid.compare_exchange_weak(expected, i));
+					}
+					size += n + 1;
+				}
+				offsets[b + 1] = size;
+			}
+		});
+	}
+	if (invalid < len) {
+		PyErr_SetString(PyExc_ValueError, ("records[" + std::to_string(invalid.load()) + "] is not a valid HuffmanCodedPos").c_str());
+		p::throw_error_already_set();
+	}
+	for (int b = 0; b < num_blocks; b++)
+		offsets[b + 1] += offsets[b];
+
+	PyObject *bytes = PyBytes_FromStringAndSize(nullptr, offsets[num_blocks]);
+	if (bytes == nullptr)
+		p::throw_error_already_set();
+	p::object result{ p::handle<>(bytes) };
+	char *out = PyBytes_AS_STRING(bytes);
+	{
+		ScopedGILRelease release;
+		parallel_for(num_blocks, [&](const int begin, const int end) {
+			char buf[MaxSFENLength];
+			for (int b = begin; b < end; b++) {
+				char *p = out + offsets[b];
+				for (int i = b * block; i < std::min(len, (b + 1) * block); i++) {
+					const int n = huffmanCodedPosToSFEN(*reinterpret_cast<const HuffmanCodedPos *>(records + record_size * i), buf);
+					memcpy(p, buf, n);
+					p += n;
+					*p++ = '\n';
+				}
+			}
+		});
+	}
+	return result;
+}
+
+/*
+	SFEN を hcp に変換する。
+	sfens : str か bytes の SFEN のリスト、または 1 行 1 局面の bytes。先頭の "sfen " と末尾の手数は省略出来る。
+	ndrecords : 変換結果を受け取る。hcp, hcpe, hcphe の配列。先頭の hcp だけを書き換える。
+*/
+void sfen_array_to_hcp(p::object sfens, np::ndarray ndrecords) {
+	const int len = (int)ndrecords.shape(0);
+	const size_t record_size = check_hcp_records(ndrecords, "records");
+	u8 *records = reinterpret_cast<u8 *>(ndrecords.get_data());
+
+	// 文字列の位置を集める。str, bytes のバッファは、それを持つ sfens (または seq) が生きている間有効。
+	std::vector<std::pair<const char *, size_t> > lines;
+	p::object seq;
+	if (PyBytes_Check(sfens.ptr())) {
+		const char *p = PyBytes_AS_STRING(sfens.ptr());
+		const char *const end = p + PyBytes_GET_SIZE(sfens.ptr());
+		lines.reserve(len);
+		while (p != end) {
+			const char *eol = reinterpret_cast<const char *>(memchr(p, '\n', end - p));
+			if (eol == nullptr)
+				eol = end;
+			lines.emplace_back(p, eol - p);
+			p = (eol == end ? end : eol + 1);
+		}
+	}
+	else {
+		seq = p::object(p::handle<>(PySequence_Fast(sfens.ptr(), "sfens must be a sequence or bytes")));
+		const Py_ssize_t size = PySequence_Fast_GET_SIZE(seq.ptr());
+		lines.reserve(size);
+		for (Py_ssize_t i = 0; i < size; i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(seq.ptr(), i);
+			char *s = nullptr;
+			Py_ssize_t n = 0;
+			if (PyUnicode_Check(item))
+				s = const_cast<char *>(PyUnicode_AsUTF8AndSize(item, &n));
+			else if (PyBytes_Check(item))
+				PyBytes_AsStringAndSize(item, &s, &n);
+			else {
+				PyErr_SetString(PyExc_TypeError, ("sfens[" + std::to_string(i) + "] must be str or bytes").c_str());
+				p::throw_error_already_set();
+			}
+			if (s == nullptr)
+				p::throw_error_already_set();
+			lines.emplace_back(s, (size_t)n);
+		}
+	}
+	if ((s64)lines.size() != len) {
+		PyErr_SetString(PyExc_ValueError, ("sfens has " + std::to_string(lines.size()) + " positions, but records has " + std::to_string(len)).c_str());
+		p::throw_error_already_set();
+	}
+
+	std::atomic<int> invalid(len);
+	{
+		ScopedGILRelease release;
+		parallel_for(len, [&](const int begin, const int end) {
+			for (int i = begin; i < end; i++) {
+				if (!sfenToHuffmanCodedPos(lines[i].first, lines[i].second, *reinterpret_cast<HuffmanCodedPos *>(records + record_size * i))) {
+					int expected = invalid.load();
+					while (i < expected && !invalid.compare_exchange_weak(expected, i));
+				}
+			}
+		});
+	}
+	if (invalid < len) {
+		const auto& line = lines[invalid.load()];
+		PyErr_SetString(PyExc_ValueError, ("incorrect SFEN string at " + std::to_string(invalid.load()) + " : " + std::string(line.first, line.second)).c_str());
+		p::throw_error_already_set();
+	}
 }
 
 Move usiToMoveBody(const Position& pos, const std::string& moveStr) {
@@ -466,12 +1761,102 @@ void sfen_to_hcpe(const char* sfen, const int eval, const char* bestMove, const
 	HuffmanCodedPosAndEval *hcpe = reinterpret_cast<HuffmanCodedPosAndEval *>(ndhcpe.get_data());
 	Position position;
 	position.set(sfen, nullptr);
-	hcpe->hcp = position.toHuffmanCodedPos();
+	const Position* positions[] = { &position };
+	toHuffmanCodedPosBatch(positions, 1, &hcpe->hcp);
 	hcpe->eval = eval;
 	hcpe->bestMove16 = static_cast<u16>(usiToMove(position, bestMove).value());
 	hcpe->gameResult = (strcmp(win, "b") == 0) ? BlackWin : WhiteWin;
 }
 
+/*
+	複数のシャード (hcp, hcpe, hcphe ファイル) からシャッフルバッファを通してランダムな順番でレコードを読む。
+	シャッフル済みのファイルを作らずに、大きなチャンク単位の連続した読み込みだけで学習データを読める。
+	files : シャードのパスのリスト
+	record_size : 1 レコードのバイト数 (hcp 32, hcpe 38, hcphe 52)
+	buffer_size : シャッフルバッファの局面数。大きいほどよく混ざり、メモリを buffer_size * record_size バイト使う。
+	chunk_size : 1 回にシャードから連続して読む局面数。buffer_size 以下にする。
+	seed : 乱数の種。同じ seed とエポックなら同じ順番になる。
+
+	read(records) は records (先頭が hcp で 1 レコードが record_size バイトの配列) を先頭から埋め、埋めた局面数を返す。
+	エポックの残りが少なければ len(records) より少なくなり、読み終わると 0 を返す。
+	next_epoch() で次のエポック、start_epoch(epoch) で指定したエポックを最初から読む。
+	同じ ShardReader を複数の Python スレッドから使ってもよい。各メソッドは内部でロックして 1 つずつ実行する。
+*/
+class ShardReader {
+public:
+	ShardReader(p::list files, const int record_size = sizeof(HuffmanCodedPosAndEval), const s64 buffer_size = 1 << 20, const s64 chunk_size = 1 << 14, const u64 seed = 0) {
+		if (record_size < (int)sizeof(HuffmanCodedPos) || chunk_size <= 0 || buffer_size < chunk_size) {
+			PyErr_SetString(PyExc_ValueError, "record_size must be at least 32, chunk_size must be positive and buffer_size must be at least chunk_size");
+			p::throw_error_already_set();
+		}
+		std::vector<std::string> paths;
+		const int file_num = (int)p::len(files);
+		for (int i = 0; i < file_num; i++)
+			paths.push_back(p::extract<std::string>(files[i]));
+		try {
+			reader_.reset(new ShardShuffleReader(paths, (size_t)record_size, buffer_size, chunk_size, seed));
+		}
+		catch (const std::runtime_error& e) {
+			PyErr_SetString(PyExc_IOError, e.what());
+			p::throw_error_already_set();
+		}
+	}
+
+	s64 read(np::ndarray ndrecords) {
+		const size_t record_size = check_hcp_records(ndrecords, "records");
+		if (record_size != reader_->recordSize()) {
+			PyErr_SetString(PyExc_TypeError, "records must have record_size bytes per record");
+			p::throw_error_already_set();
+		}
+		const s64 len = (s64)ndrecords.shape(0);
+		void *records = ndrecords.get_data();
+
+		s64 num = 0;
+		std::string error;
+		{
+			ScopedGILRelease release;
+			std::lock_guard<std::mutex> lock(mutex_);
+			try {
+				num = reader_->read(records, len);
+			}
+			catch (const std::runtime_error& e) {
+				error = e.what();
+			}
+		}
+		if (!error.empty()) {
+			PyErr_SetString(PyExc_IOError, error.c_str());
+			p::throw_error_already_set();
+		}
+		return num;
+	}
+
+	void start_epoch(const u64 epoch) {
+		ScopedGILRelease release;
+		std::lock_guard<std::mutex> lock(mutex_);
+		reader_->startEpoch(epoch);
+	}
+	void next_epoch() {
+		ScopedGILRelease release;
+		std::lock_guard<std::mutex> lock(mutex_);
+		reader_->nextEpoch();
+	}
+	u64 epoch() {
+		ScopedGILRelease release;
+		std::lock_guard<std::mutex> lock(mutex_);
+		return reader_->epoch();
+	}
+	s64 left() {
+		ScopedGILRelease release;
+		std::lock_guard<std::mutex> lock(mutex_);
+		return reader_->left();
+	}
+	s64 size() const { return reader_->size(); } // 変わらないのでロックは不要
+
+private:
+	std::unique_ptr<ShardShuffleReader> reader_; // mutex_ をロックして使う
+	std::mutex mutex_;
+};
+
 BOOST_PYTHON_MODULE(hcp_decoder) {
 	Py_Initialize();
 	np::initialize();
@@ -480,13 +1865,44 @@ BOOST_PYTHON_MODULE(hcp_decoder) {
 	Position::initZobrist();
 	HuffmanCodedPos::init();
 
-	p::def("decode_with_result", decode_with_result);
-	p::def("decode_with_move", decode_with_move);
-	p::def("decode_with_value", decode_with_value);
+	p::def("set_num_threads", set_num_threads);
+	p::def("get_num_threads", get_num_threads);
+	p::def("decode_with_result", decode_with_result, (p::arg("hcpe"), p::arg("features1"), p::arg("features2"), p::arg("result"), p::arg("mirror") = p::object()));
+	p::def("decode_with_move", decode_with_move, (p::arg("hcpe"), p::arg("features1"), p::arg("features2"), p::arg("move"), p::arg("mirror") = p::object()));
+	p::def("decode_with_value", decode_with_value, (p::arg("hcpe"), p::arg("features1"), p::arg("features2"), p::arg("value"), p::arg("move"), p::arg("result"), p::arg("mirror") = p::object()));
+	p::def("decode_features", decode_features, (p::arg("hcp"), p::arg("features1"), p::arg("features2"), p::arg("mirror") = p::object()));
+	p::def("decode_hcphe_with_value", decode_hcphe_with_value, (p::arg("hcphe"), p::arg("features1"), p::arg("features2"), p::arg("value"), p::arg("move"), p::arg("result"), p::arg("mirror") = p::object()));
+	p::def("decode_sparse_features", decode_sparse_features, (p::arg("hcp"), p::arg("indices"), p::arg("hands"), p::arg("check"), p::arg("mirror") = p::object()));
+	p::def("decode_sparse_with_result", decode_sparse_with_result, (p::arg("hcpe"), p::arg("indices"), p::arg("hands"), p::arg("check"), p::arg("result"), p::arg("mirror") = p::object()));
+	p::def("decode_sparse_with_move", decode_sparse_with_move, (p::arg("hcpe"), p::arg("indices"), p::arg("hands"), p::arg("check"), p::arg("move"), p::arg("mirror") = p::object()));
+	p::def("decode_sparse_with_value", decode_sparse_with_value, (p::arg("hcpe"), p::arg("indices"), p::arg("hands"), p::arg("check"), p::arg("value"), p::arg("move"), p::arg("result"), p::arg("mirror") = p::object()));
+	p::def("decode_legal_mask", decode_legal_mask, (p::arg("hcpe"), p::arg("mask"), p::arg("mirror") = p::object()));
+	p::def("labels_from_move16", labels_from_move16, (p::arg("hcp"), p::arg("move16"), p::arg("labels"), p::arg("mirror") = p::object()));
+	p::def("move16_from_label", move16_from_label, (p::arg("hcp"), p::arg("labels"), p::arg("move16"), p::arg("mirror") = p::object()));
+	p::def("hcp_keys", hcp_keys);
+	p::class_<HcpeLoader, boost::noncopyable>("HcpeLoader", p::init<p::list, int, p::optional<int, int, bool, unsigned int, bool> >())
+		.def("next", &HcpeLoader::next)
+		.def("__len__", &HcpeLoader::size);
+	p::class_<ShardReader, boost::noncopyable>("ShardReader", p::init<p::list, p::optional<int, s64, s64, u64> >())
+		.def("read", &ShardReader::read)
+		.def("start_epoch", &ShardReader::start_epoch)
+		.def("next_epoch", &ShardReader::next_epoch)
+		.add_property("epoch", &ShardReader::epoch)
+		.add_property("left", &ShardReader::left)
+		.def("__len__", &ShardReader::size);
+	p::class_<Decoder, boost::noncopyable>("Decoder", p::init<int, p::optional<int> >())
+		.def("decode_with_value", &Decoder::decode_with_value, (p::arg("self"), p::arg("hcpe"), p::arg("mirror") = p::object()))
+		.add_property("max_batch_size", &Decoder::max_batch_size)
+		.add_property("num_threads", &Decoder::num_threads)
+		.add_property("last_time", &Decoder::last_time)
+		.add_property("total_time", &Decoder::total_time);
 	p::def("print_sfen_from_hcp", print_sfen_from_hcp);
 	p::def("print_sfen_from_hcpe", print_sfen_from_hcpe);
 	p::def("print_sfen_from_hcphe", print_sfen_from_hcphe);
+	p::def("find_duplicates", find_duplicates);
 	p::def("check_duplicates", check_duplicates);
 	p::def("sfen_to_hcp", sfen_to_hcp);
 	p::def("sfen_to_hcpe", sfen_to_hcpe);
+	p::def("hcp_to_sfen_bytes", hcp_to_sfen_bytes);
+	p::def("sfen_array_to_hcp", sfen_array_to_hcp);
 }
\ No newline at end of file
@@ -224,4 +224,28 @@ inline Move move16toMove(const Move move, const Position& pos) {
     return move | pieceType2Move(ptFrom) | capturedPieceType2Move(move.to(), pos);
 }
 
+// ファイルから読んだ指し手のように、pos で合法か分からない 16 bit の指し手を Move に変換する。
+// 合法手でなければ moveNone を返す。doMove() する前に使うこと。
+inline Move move16toLegalMove(const Move move16, const Position& pos) {
+    if (!move16 || move16.to() >= SquareNum || move16.from() >= SquareNum + Gold)
+        return Move::moveNone();
+    const Move move = move16toMove(move16, pos);
+    if (move.isDrop()) {
+        if (move.isPromotion())
+            return Move::moveNone();
+    }
+    else {
+        // 移動元に駒が無い指し手、成れない駒や敵陣に関わらない成りは moveIsPseudoLegal<false>() では除けない。
+        const PieceType ptFrom = move.pieceTypeFrom();
+        if (ptFrom == Occupied)
+            return Move::moveNone();
+        if (move.isPromotion()
+            && (ptFrom >= Gold || !(canPromote(pos.turn(), makeRank(move.to())) || canPromote(pos.turn(), makeRank(move.from())))))
+            return Move::moveNone();
+    }
+    if (!pos.moveIsPseudoLegal<false>(move) || !pos.pseudoLegalMoveIsLegal<false, false>(move, pos.pinnedBB()))
+        return Move::moveNone();
+    return move;
+}
+
 #endif // #ifndef APERY_MOVE_HPP
@@ -76,8 +76,8 @@ const HuffmanCode HuffmanCodedPos::handCodeTable[HandPieceNum][ColorNum] = {
     {{Binary<   111111>::value, 7}, {Binary<  1111111>::value, 7}}, // HRook
 };
 
-HuffmanCodeToPieceHash HuffmanCodedPos::boardCodeToPieceHash;
-HuffmanCodeToPieceHash HuffmanCodedPos::handCodeToPieceHash;
+HuffmanCodeToPiece HuffmanCodedPos::boardCodeToPieceTable[256];
+HuffmanCodeToPiece HuffmanCodedPos::handCodeToPieceTable[256];
 
 // やねうら王のpacked sfenのハフマン符号
 //   ※　 なのはminiの符号化から、変換が楽になるように単純化。
@@ -157,8 +157,8 @@ const HuffmanCode PackedSfen::handCodeTable[HandPieceNum][ColorNum] = {
 	{ { Binary<    11111>::value, 7 },{ Binary<  1011111>::value, 7 } }, // HRook
 };
 
-HuffmanCodeToPieceHash PackedSfen::boardCodeToPieceHash;
-HuffmanCodeToPieceHash PackedSfen::handCodeToPieceHash;
+HuffmanCodeToPiece PackedSfen::boardCodeToPieceTable[256];
+HuffmanCodeToPiece PackedSfen::handCodeToPieceTable[256];
 
 const CharToPieceUSI g_charToPieceUSI;
 
@@ -1726,6 +1726,49 @@ void Position::initZobrist() {
     zobExclusion_ = g_mt64bit.random() & ~UINT64_C(1);
 }
 
+bool Position::getKey(const HuffmanCodedPos& hcp, Key& key) {
+    BitStream64 bs(hcp.data);
+
+    // 手番
+    const Color turn = static_cast<Color>(bs.getBit());
+
+    // 玉の位置
+    const Square ksq0 = static_cast<Square>(bs.getBits(7));
+    const Square ksq1 = static_cast<Square>(bs.getBits(7));
+    if (!isInSquare(ksq0) || !isInSquare(ksq1) || ksq0 == ksq1)
+        return false;
+    Key boardKey = zobrist(King, ksq0, Black) + zobrist(King, ksq1, White);
+
+    // 盤上の駒
+    for (Square sq = SQ11; sq < SquareNum; ++sq) {
+        if (sq == ksq0 || sq == ksq1)
+            continue;
+        if (bs.end())
+            return false;
+        const Piece pc = bs.getPiece(HuffmanCodedPos::boardCodeToPieceTable);
+        if (pc == PieceNone)
+            return false;
+        if (pc != Empty)
+            boardKey += zobrist(pieceToPieceType(pc), sq, pieceToColor(pc));
+    }
+    if (turn == White)
+        boardKey ^= zobTurn();
+
+    // 持ち駒
+    Key handKey = 0;
+    while (!bs.end()) {
+        const Piece pc = bs.getPiece(HuffmanCodedPos::handCodeToPieceTable);
+        if (pc == PieceNone)
+            return false;
+        handKey += zobHand(pieceTypeToHandPiece(pieceToPieceType(pc)), pieceToColor(pc));
+    }
+    if (bs.curr() != 256)
+        return false;
+
+    key = boardKey + handKey;
+    return true;
+}
+
 // ある指し手を指した後のhash keyを返す。
 Key Position::getKeyAfter(const Move m) const {
 	Color Us = this->turn(); // 現局面の手番
@@ -1904,7 +1947,7 @@ std::string Position::toSFEN(const Ply ply) const {
 HuffmanCodedPos Position::toHuffmanCodedPos() const {
     HuffmanCodedPos result;
     result.clear();
-    BitStream bs(result.data);
+    BitStream64Writer bs(result.data);
     // 手番 (1bit)
     bs.putBit(turn());
 
@@ -1930,11 +1973,17 @@ HuffmanCodedPos Position::toHuffmanCodedPos() const {
                 bs.putBits(hc.code, hc.numOfBits);
         }
     }
+    bs.flush();
     assert(bs.data() == std::end(result.data));
     assert(bs.curr() == 0);
     return result;
 }
 
+void toHuffmanCodedPosBatch(const Position* positions[], const size_t n, HuffmanCodedPos* hcps) {
+    for (size_t i = 0; i < n; ++i)
+        hcps[i] = positions[i]->toHuffmanCodedPos();
+}
+
 bool Position::isOK() const {
     static Key prevKey;
     const bool debugAll = true;
@@ -2238,8 +2287,7 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     clear();
     setSearcher(s);
 
-    HuffmanCodedPos tmp = hcp; // ローカルにコピー
-    BitStream bs(tmp.data);
+    BitStream64 bs(hcp.data);
 
     // 手番
     turn_ = static_cast<Color>(bs.getBit());
@@ -2247,6 +2295,8 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     // 玉の位置
     Square sq0 = (Square)bs.getBits(7);
     Square sq1 = (Square)bs.getBits(7);
+    if (sq0 >= SquareNum || sq1 >= SquareNum || sq0 == sq1)
+        goto INCORRECT_HUFFMAN_CODE;
     setPiece(BKing, static_cast<Square>(sq0));
     setPiece(WKing, static_cast<Square>(sq1));
 
@@ -2254,32 +2304,22 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     for (Square sq = SQ11; sq < SquareNum; ++sq) {
         if (pieceToPieceType(piece(sq)) == King) // piece(sq) は BKing, WKing, Empty のどれか。
             continue;
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) != PieceNone) {
-                const Piece pc = HuffmanCodedPos::boardCodeToPieceHash.value(hc.key);
-                if (pc != Empty)
-                    setPiece(HuffmanCodedPos::boardCodeToPieceHash.value(hc.key), sq);
-                break;
-            }
-        }
-        if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) == PieceNone)
+        if (bs.end())
+            goto INCORRECT_HUFFMAN_CODE;
+        const Piece pc = bs.getPiece(HuffmanCodedPos::boardCodeToPieceTable);
+        if (pc == PieceNone)
             goto INCORRECT_HUFFMAN_CODE;
+        if (pc != Empty)
+            setPiece(pc, sq);
     }
-    while (bs.data() != std::end(tmp.data)) {
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            const Piece pc = HuffmanCodedPos::handCodeToPieceHash.value(hc.key);
-            if (pc != PieceNone) {
-                hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
-                break;
-            }
-        }
-        if (HuffmanCodedPos::handCodeToPieceHash.value(hc.key) == PieceNone)
+    while (!bs.end()) {
+        const Piece pc = bs.getPiece(HuffmanCodedPos::handCodeToPieceTable);
+        if (pc == PieceNone)
             goto INCORRECT_HUFFMAN_CODE;
+        hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
     }
+    if (bs.curr() != 256)
+        goto INCORRECT_HUFFMAN_CODE;
 
     kingSquare_[Black] = bbOf(King, Black).constFirstOneFromSQ11();
     kingSquare_[White] = bbOf(King, White).constFirstOneFromSQ11();
@@ -2308,8 +2348,7 @@ bool Position::set(const PackedSfen& sfen, Thread* th) {
 	clear();
 	setSearcher(s);
 
-	PackedSfen tmp = sfen; // ローカルにコピー
-	BitStream bs(tmp.data);
+	BitStream64 bs(sfen.data);
 
 	// 手番
 	turn_ = static_cast<Color>(bs.getBit());
@@ -2317,6 +2356,8 @@ bool Position::set(const PackedSfen& sfen, Thread* th) {
 	// 玉の位置
 	Square sq0 = (Square)bs.getBits(7);
 	Square sq1 = (Square)bs.getBits(7);
+	if (sq0 >= SquareNum || sq1 >= SquareNum || sq0 == sq1)
+		goto INCORRECT_HUFFMAN_CODE;
 	setPiece(BKing, static_cast<Square>(sq0));
 	setPiece(WKing, static_cast<Square>(sq1));
 
@@ -2324,32 +2365,22 @@ bool Position::set(const PackedSfen& sfen, Thread* th) {
 	for (Square sq = SQ11; sq < SquareNum; ++sq) {
 		if (pieceToPieceType(piece(sq)) == King) // piece(sq) は BKing, WKing, Empty のどれか。
 			continue;
-		HuffmanCode hc = { 0, 0 };
-		while (hc.numOfBits <= 8) {
-			hc.code |= bs.getBit() << hc.numOfBits++;
-			if (PackedSfen::boardCodeToPieceHash.value(hc.key) != PieceNone) {
-				const Piece pc = PackedSfen::boardCodeToPieceHash.value(hc.key);
-				if (pc != Empty)
-					setPiece(PackedSfen::boardCodeToPieceHash.value(hc.key), sq);
-				break;
-			}
-		}
-		if (PackedSfen::boardCodeToPieceHash.value(hc.key) == PieceNone)
+		if (bs.end())
 			goto INCORRECT_HUFFMAN_CODE;
+		const Piece pc = bs.getPiece(PackedSfen::boardCodeToPieceTable);
+		if (pc == PieceNone)
+			goto INCORRECT_HUFFMAN_CODE;
+		if (pc != Empty)
+			setPiece(pc, sq);
 	}
-	while (bs.data() != std::end(tmp.data)) {
-		HuffmanCode hc = { 0, 0 };
-		while (hc.numOfBits <= 8) {
-			hc.code |= bs.getBit() << hc.numOfBits++;
-			const Piece pc = PackedSfen::handCodeToPieceHash.value(hc.key);
-			if (pc != PieceNone) {
-				hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
-				break;
-			}
-		}
-		if (PackedSfen::handCodeToPieceHash.value(hc.key) == PieceNone)
+	while (!bs.end()) {
+		const Piece pc = bs.getPiece(PackedSfen::handCodeToPieceTable);
+		if (pc == PieceNone)
 			goto INCORRECT_HUFFMAN_CODE;
+		hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
 	}
+	if (bs.curr() != 256)
+		goto INCORRECT_HUFFMAN_CODE;
 
 	kingSquare_[Black] = bbOf(King, Black).constFirstOneFromSQ11();
 	kingSquare_[White] = bbOf(King, White).constFirstOneFromSQ11();
@@ -2372,6 +2403,328 @@ INCORRECT_HUFFMAN_CODE:
 	return false;
 }
 
+namespace {
+    // 持ち駒を書き込む順番
+    const HandPiece HuffmanCodedPosHandOrder[HandPieceNum] = { HPawn, HLance, HKnight, HSilver, HGold, HBishop, HRook };
+    const HandPiece PackedSfenHandOrder[HandPieceNum] = { HPawn, HLance, HKnight, HSilver, HBishop, HRook, HGold }; // やねうら王の駒の順番
+
+    // FROM の符号で書かれた 256 bit の局面を TO の符号に付け替える。
+    template <typename FROM, typename TO>
+    bool transcodeHuffmanCode(const u8* src, u8* dst, const HandPiece handOrder[HandPieceNum]) {
+        BitStream64 bs(src);
+        BitStream64Writer ws(dst);
+
+        // 手番と玉の位置はそのまま。Position::set() と同じく、盤外や同じ位置の玉は不正な符号とする。
+        ws.putBit(bs.getBit());
+        const u8 ksq0 = bs.getBits(7);
+        const u8 ksq1 = bs.getBits(7);
+        if (ksq0 >= SquareNum || ksq1 >= SquareNum || ksq0 == ksq1)
+            return false;
+        ws.putBits(ksq0, 7);
+        ws.putBits(ksq1, 7);
+
+        // 盤上の駒
+        for (u8 sq = SQ11; sq < SquareNum; ++sq) {
+            if (sq == ksq0 || sq == ksq1)
+                continue;
+            if (bs.end())
+                return false;
+            const Piece pc = bs.getPiece(FROM::boardCodeToPieceTable);
+            if (pc == PieceNone)
+                return false;
+            const HuffmanCode hc = TO::boardCodeTable[pc];
+            ws.putBits(hc.code, hc.numOfBits);
+        }
+
+        // 持ち駒は枚数を数えてから、TO の順番で書き込む。
+        u8 handNum[ColorNum][HandPieceNum] = {};
+        while (!bs.end()) {
+            const Piece pc = bs.getPiece(FROM::handCodeToPieceTable);
+            if (pc == PieceNone)
+                return false;
+            ++handNum[pieceToColor(pc)][pieceTypeToHandPiece(pieceToPieceType(pc))];
+        }
+        if (bs.curr() != 256)
+            return false;
+        for (Color c = Black; c < ColorNum; ++c) {
+            for (int i = 0; i < HandPieceNum; ++i) {
+                const HandPiece hp = handOrder[i];
+                const HuffmanCode hc = TO::handCodeTable[hp][c];
+                for (int n = 0; n < handNum[c][hp]; ++n)
+                    ws.putBits(hc.code, hc.numOfBits);
+            }
+        }
+        ws.flush();
+        assert(ws.data() == dst + 32);
+        assert(ws.curr() == 0);
+        return true;
+    }
+}
+
+bool packedSfenToHuffmanCodedPos(const PackedSfen& sfen, HuffmanCodedPos& hcp) {
+    return transcodeHuffmanCode<PackedSfen, HuffmanCodedPos>(sfen.data, hcp.data, HuffmanCodedPosHandOrder);
+}
+
+bool huffmanCodedPosToPackedSfen(const HuffmanCodedPos& hcp, PackedSfen& sfen) {
+    return transcodeHuffmanCode<HuffmanCodedPos, PackedSfen>(hcp.data, sfen.data, PackedSfenHandOrder);
+}
+
+namespace {
+    // USI の駒の文字から Piece を引くテーブル。駒でない文字は PieceNone。
+    struct USICharToPieceTable {
+        Piece value[128];
+        USICharToPieceTable() {
+            std::fill(std::begin(value), std::end(value), PieceNone);
+            for (Piece pc = BPawn; pc <= BKing; ++pc) {
+                value[static_cast<u8>(PieceToCharUSITable[pc][0])] = pc;
+                value[static_cast<u8>(PieceToCharUSITable[inverse(pc)][0])] = inverse(pc);
+            }
+        }
+        Piece operator () (const char c) const { return (static_cast<u8>(c) < 128 ? value[static_cast<u8>(c)] : PieceNone); }
+    };
+    const USICharToPieceTable usiCharToPiece;
+
+    // USI の規格の持ち駒の表記順
+    const HandPiece USIHandOrder[HandPieceNum] = { HRook, HBishop, HGold, HSilver, HKnight, HLance, HPawn };
+
+    inline char* writeNumber(char* p, u32 n) {
+        char digits[10];
+        int i = 0;
+        do {
+            digits[i++] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while (n);
+        while (i)
+            *p++ = digits[--i];
+        return p;
+    }
+}
+
+int huffmanCodedPosToSFEN(const HuffmanCodedPos& hcp, char* buf, const int ply) {
+    BitStream64 bs(hcp.data);
+    Piece board[SquareNum] = {};
+    u8 handNum[ColorNum][HandPieceNum] = {};
+
+    const Color turn = static_cast<Color>(bs.getBit());
+    const u8 ksq0 = bs.getBits(7);
+    const u8 ksq1 = bs.getBits(7);
+    if (ksq0 >= SquareNum || ksq1 >= SquareNum || ksq0 == ksq1)
+        return 0;
+    board[ksq0] = BKing;
+    board[ksq1] = WKing;
+    for (u8 sq = SQ11; sq < SquareNum; ++sq) {
+        if (sq == ksq0 || sq == ksq1)
+            continue;
+        if (bs.end())
+            return 0;
+        const Piece pc = bs.getPiece(HuffmanCodedPos::boardCodeToPieceTable);
+        if (pc == PieceNone)
+            return 0;
+        board[sq] = pc;
+    }
+    while (!bs.end()) {
+        const Piece pc = bs.getPiece(HuffmanCodedPos::handCodeToPieceTable);
+        if (pc == PieceNone)
+            return 0;
+        ++handNum[pieceToColor(pc)][pieceTypeToHandPiece(pieceToPieceType(pc))];
+    }
+    if (bs.curr() != 256)
+        return 0;
+
+    // Position::toSFEN() と同じ文字列を書き込む。
+    char* p = buf;
+    memcpy(p, "sfen ", 5);
+    p += 5;
+    for (Rank rank = Rank1; rank <= Rank9; ++rank) {
+        int space = 0;
+        for (File file = File9; file >= File1; --file) {
+            const Piece pc = board[makeSquare(file, rank)];
+            if (pc == Empty)
+                ++space;
+            else {
+                if (space) {
+                    *p++ = static_cast<char>('0' + space);
+                    space = 0;
+                }
+                for (const char* s = PieceToCharUSITable[pc]; *s; ++s)
+                    *p++ = *s;
+            }
+        }
+        if (space)
+            *p++ = static_cast<char>('0' + space);
+        if (rank != Rank9)
+            *p++ = '/';
+    }
+    *p++ = ' ';
+    *p++ = (turn == Black ? 'b' : 'w');
+    *p++ = ' ';
+    const char* handBegin = p;
+    for (Color c = Black; c < ColorNum; ++c) {
+        for (const HandPiece hp : USIHandOrder) {
+            const int num = handNum[c][hp];
+            if (num == 0)
+                continue;
+            if (num != 1)
+                p = writeNumber(p, num);
+            *p++ = PieceToCharUSITable[colorAndHandPieceToPiece(c, hp)][0];
+        }
+    }
+    if (p == handBegin)
+        *p++ = '-';
+    *p++ = ' ';
+    p = writeNumber(p, ply);
+    *p = '\0';
+    return static_cast<int>(p - buf);
+}
+
+bool sfenToHuffmanCodedPos(const char* sfen, const size_t len, HuffmanCodedPos& hcp) {
+    const char* p = sfen;
+    const char* const end = sfen + len;
+    Piece board[SquareNum] = {};
+    u8 handNum[ColorNum][HandPieceNum] = {};
+    Square ksq[ColorNum] = { SquareNum, SquareNum };
+
+    if (len >= 5 && memcmp(p, "sfen ", 5) == 0)
+        p += 5;
+
+    // 盤上の駒
+    for (Rank rank = Rank1; rank <= Rank9; ++rank) {
+        if (rank != Rank1) {
+            if (p == end || *p++ != '/')
+                return false;
+        }
+        int file = 9; // 次に駒を置く筋 + 1
+        while (file > 0 && p != end) {
+            const char c = *p++;
+            if ('1' <= c && c <= '9') {
+                file -= c - '0';
+                continue;
+            }
+            Piece pc;
+            if (c == '+') {
+                if (p == end)
+                    return false;
+                pc = usiCharToPiece(*p++);
+                if (pc == PieceNone || pieceToPieceType(pc) == Gold || pieceToPieceType(pc) == King)
+                    return false;
+                pc += Promoted;
+            }
+            else {
+                pc = usiCharToPiece(c);
+                if (pc == PieceNone)
+                    return false;
+            }
+            const Square sq = makeSquare(static_cast<File>(--file), rank);
+            if (pieceToPieceType(pc) == King) {
+                if (ksq[pieceToColor(pc)] != SquareNum)
+                    return false;
+                ksq[pieceToColor(pc)] = sq;
+            }
+            board[sq] = pc;
+        }
+        if (file != 0)
+            return false;
+    }
+    if (ksq[Black] == SquareNum || ksq[White] == SquareNum)
+        return false;
+
+    // 手番
+    if (end - p < 3 || p[0] != ' ' || (p[1] != 'b' && p[1] != 'w') || p[2] != ' ')
+        return false;
+    const Color turn = (p[1] == 'b' ? Black : White);
+    p += 3;
+
+    // 持ち駒
+    if (p != end && *p == '-')
+        ++p;
+    else {
+        int digits = 0;
+        while (p != end && *p != ' ') {
+            const char c = *p++;
+            if ('0' <= c && c <= '9') {
+                digits = digits * 10 + (c - '0');
+                if (digits > 18)
+                    return false;
+                continue;
+            }
+            const Piece pc = usiCharToPiece(c);
+            if (pc == PieceNone || pieceToPieceType(pc) == King)
+                return false;
+            u8& num = handNum[pieceToColor(pc)][pieceTypeToHandPiece(pieceToPieceType(pc))];
+            num += (digits == 0 ? 1 : digits);
+            if (num > 18)
+                return false;
+            digits = 0;
+        }
+        if (digits != 0)
+            return false;
+    }
+
+    // 手数は HuffmanCodedPos に含まれないので読み飛ばす。
+    if (p != end && *p == ' ') {
+        ++p;
+        while (p != end && '0' <= *p && *p <= '9')
+            ++p;
+    }
+    while (p != end && (*p == '\r' || *p == '\n' || *p == ' '))
+        ++p;
+    if (p != end)
+        return false;
+
+    // 駒が全て揃っていれば、ちょうど 256 bit になる。
+    int numOfBits = 1 + 7 + 7;
+    for (Square sq = SQ11; sq < SquareNum; ++sq) {
+        if (pieceToPieceType(board[sq]) != King)
+            numOfBits += HuffmanCodedPos::boardCodeTable[board[sq]].numOfBits;
+    }
+    for (Color c = Black; c < ColorNum; ++c) {
+        for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
+            numOfBits += handNum[c][hp] * HuffmanCodedPos::handCodeTable[hp][c].numOfBits;
+    }
+    if (numOfBits != 256)
+        return false;
+
+    // Position::toHuffmanCodedPos() と同じ順番で書き込む。
+    BitStream64Writer ws(hcp.data);
+    ws.putBit(turn);
+    ws.putBits(ksq[Black], 7);
+    ws.putBits(ksq[White], 7);
+    for (Square sq = SQ11; sq < SquareNum; ++sq) {
+        if (pieceToPieceType(board[sq]) == King)
+            continue;
+        const HuffmanCode hc = HuffmanCodedPos::boardCodeTable[board[sq]];
+        ws.putBits(hc.code, hc.numOfBits);
+    }
+    for (Color c = Black; c < ColorNum; ++c) {
+        for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
+            const HuffmanCode hc = HuffmanCodedPos::handCodeTable[hp][c];
+            for (int n = 0; n < handNum[c][hp]; ++n)
+                ws.putBits(hc.code, hc.numOfBits);
+        }
+    }
+    ws.flush();
+    assert(ws.data() == std::end(hcp.data));
+    assert(ws.curr() == 0);
+    return true;
+}
+
+
+Bitboard BoardOnlyPosition::computeCheckers() const {
+    const Color us = turn();
+    const Color them = oppositeColor(us);
+    const Square ksq = kingSquare(us);
+    const Bitboard occupied = occupiedBB();
+    const Bitboard golds = bbOf(Gold) | bbOf(ProPawn) | bbOf(ProLance) | bbOf(ProKnight) | bbOf(ProSilver);
+    return ((pawnAttack(us, ksq) & bbOf(Pawn))
+            | (lanceAttack(us, ksq, occupied) & bbOf(Lance))
+            | (knightAttack(us, ksq) & bbOf(Knight))
+            | (silverAttack(us, ksq) & (bbOf(Silver) | bbOf(Dragon)))
+            | (goldAttack(us, ksq) & (golds | bbOf(Horse)))
+            | (bishopAttack(ksq, occupied) & (bbOf(Bishop) | bbOf(Horse)))
+            | (rookAttack(ksq, occupied) & (bbOf(Rook) | bbOf(Dragon))))
+        & bbOf(them);
+}
+
 
 bool Position::moveGivesCheck(const Move move) const {
     return moveGivesCheck(move, CheckInfo(*this));
@@ -135,42 +135,137 @@ private:
     int curr_; // 1byte 中の bit の位置
 };
 
+// 64 bit 溜まる毎にまとめて書き込む BitStream。
+class BitStream64Writer {
+public:
+    // 書き込む先頭データのポインタをセットする。
+    explicit BitStream64Writer(u8* d) : data_(d), buf_(0), curr_(0) {}
+    // val の値を numOfBits bit 書き込む。val は numOfBits bit を超えないこと。
+    void putBits(const u64 val, const int numOfBits) {
+        assert(numOfBits <= 32);
+        assert((val >> numOfBits) == 0);
+        buf_ |= val << curr_;
+        curr_ += numOfBits;
+        if (curr_ >= 64) {
+            std::memcpy(data_, &buf_, sizeof(buf_));
+            data_ += sizeof(buf_);
+            curr_ -= 64;
+            buf_ = val >> (numOfBits - curr_); // 書き込めなかった上位 bit
+        }
+    }
+    void putBit(const u8 bit) { putBits(bit, 1); }
+    // 64 bit に満たない残りの bit を書き込む。
+    void flush() {
+        std::memcpy(data_, &buf_, (curr_ + 7) / 8);
+    }
+    u8* data() const { return data_; }
+    int curr() const { return curr_; }
+
+private:
+    u8* data_;
+    u64 buf_;
+    int curr_; // buf_ 中の bit の位置
+};
+
 union HuffmanCode {
     struct {
         u8 code;      // 符号化時の bit 列
         u8 numOfBits; // 使用 bit 数
     };
-    u16 key; // std::unordered_map の key として使う。
+    u16 key;
+};
+
+// 先読みした 8 bit を index として、符号に対応する駒と符号の bit 数を引くテーブルの要素。
+// 符号は最大 8 bit なので、1 回テーブルを引けば 1 駒分を復号出来る。
+struct HuffmanCodeToPiece {
+    u8 piece;     // Piece
+    u8 numOfBits; // 0 なら不正な符号
 };
 
-struct HuffmanCodeToPieceHash : public std::unordered_map<u16, Piece> {
-    Piece value(const u16 key) const {
-        const auto it = find(key);
-        if (it == std::end(*this))
-            return PieceNone;
-        return it->second;
+// HuffmanCodeToPiece のテーブルを作成する。
+inline void initHuffmanCodeToPieceTable(HuffmanCodeToPiece table[256], const HuffmanCode hc, const Piece pc) {
+    for (int i = 0; i < 256; ++i) {
+        if ((i & ((1 << hc.numOfBits) - 1)) == hc.code) {
+            table[i].piece = static_cast<u8>(pc);
+            table[i].numOfBits = hc.numOfBits;
+        }
     }
+}
+
+// 256 bit の局面データを 64 bit 単位で読み込む。
+// BitStream と異なり、1 bit ずつではなく符号単位で読み込む。
+class BitStream64 {
+public:
+    explicit BitStream64(const u8* d) : curr_(0) {
+        std::memcpy(data_, d, 32);
+        data_[4] = 0; // 末尾で 8 bit 先読みしたときの番兵
+    }
+    // numOfBits bit 読み込む。8 bit まで。
+    u8 getBits(const int numOfBits) {
+        assert(numOfBits <= 8);
+        const u8 result = peek8() & ((1 << numOfBits) - 1);
+        curr_ += numOfBits;
+        return result;
+    }
+    u8 getBit() { return getBits(1); }
+    // 1 駒分の符号を読み込む。不正な符号なら PieceNone を返す。
+    Piece getPiece(const HuffmanCodeToPiece table[256]) {
+        const HuffmanCodeToPiece hc = table[peek8()];
+        curr_ += hc.numOfBits;
+        return (hc.numOfBits != 0 ? static_cast<Piece>(hc.piece) : PieceNone);
+    }
+    // 読み込んだ bit 数
+    int curr() const { return curr_; }
+    bool end() const { return curr_ >= 256; }
+
+private:
+    u8 peek8() const {
+        const int index = curr_ >> 6;
+        const int shift = curr_ & 63;
+        u64 bits = data_[index] >> shift;
+        if (shift > 56)
+            bits |= data_[index + 1] << (64 - shift);
+        return static_cast<u8>(bits);
+    }
+
+    u64 data_[5];
+    int curr_;
 };
 
 // Huffman 符号化された局面のデータ構造。256 bit で局面を表す。
 struct HuffmanCodedPos {
     static const HuffmanCode boardCodeTable[PieceNone];
     static const HuffmanCode handCodeTable[HandPieceNum][ColorNum];
-    static HuffmanCodeToPieceHash boardCodeToPieceHash;
-    static HuffmanCodeToPieceHash handCodeToPieceHash;
+    static HuffmanCodeToPiece boardCodeToPieceTable[256];
+    static HuffmanCodeToPiece handCodeToPieceTable[256];
     static void init() {
+        std::fill(std::begin(boardCodeToPieceTable), std::end(boardCodeToPieceTable), HuffmanCodeToPiece{ PieceNone, 0 });
+        std::fill(std::begin(handCodeToPieceTable), std::end(handCodeToPieceTable), HuffmanCodeToPiece{ PieceNone, 0 });
         for (Piece pc = Empty; pc <= BDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                initHuffmanCodeToPieceTable(boardCodeToPieceTable, boardCodeTable[pc], pc);
         for (Piece pc = WPawn; pc <= WDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                initHuffmanCodeToPieceTable(boardCodeToPieceTable, boardCodeTable[pc], pc);
         for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
             for (Color c = Black; c < ColorNum; ++c)
-                handCodeToPieceHash[handCodeTable[hp][c].key] = colorAndPieceTypeToPiece(c, handPieceToPieceType(hp));
+                initHuffmanCodeToPieceTable(handCodeToPieceTable, handCodeTable[hp][c], colorAndPieceTypeToPiece(c, handPieceToPieceType(hp)));
     }
     void clear() { std::fill(std::begin(data), std::end(data), 0); }
 
+    // 以下は Position に復号せずに data から直接読み込む。
+    // 手番と玉の位置は先頭 15 bit の固定位置にある。
+    Color turn() const { return static_cast<Color>(data[0] & 1); }
+    Square kingSquare(const Color c) const {
+        const u32 bits = data[0] | (data[1] << 8);
+        return static_cast<Square>((bits >> (1 + 7 * c)) & 0x7f);
+    }
+    // c の玉が敵陣 (3段目以内) にいるか。検証前の data から読むので、玉の位置が盤外なら false を返す。
+    bool kingInOpponentField(const Color c) const {
+        const Square ksq = kingSquare(c);
+        return isInSquare(ksq) && canPromote(c, makeRank(ksq));
+    }
+
     u8 data[32];
 };
 static_assert(sizeof(HuffmanCodedPos) == 32, "");
@@ -192,22 +287,43 @@ struct HuffmanCodedPosWithHistoryAndEval {
 };
 static_assert(sizeof(HuffmanCodedPosWithHistoryAndEval) == 52, "");
 
+// 対局の連続した局面をまとめて保存する形式 (hcpc)。
+// HuffmanCodedPosChainHeader の後に、局面毎の HuffmanCodedPosChainEntry を num 個並べる。
+// 2 局面目以降は、前の局面から nextMove16 を指して復元する。
+// 索引ファイル (hcpc のファイル名 + ".idx") には、対局毎の header の位置 (byte) を u64 で対局順に並べる。
+struct HuffmanCodedPosChainHeader {
+	HuffmanCodedPos hcp; // 開始局面
+	u16 num; // 局面数
+	GameResult gameResult; // 対局の結果。全局面で同じ。
+	u8 padding;
+};
+static_assert(sizeof(HuffmanCodedPosChainHeader) == 36, "");
+
+struct HuffmanCodedPosChainEntry {
+	s16 eval;
+	u16 bestMove16;
+	u16 nextMove16; // 次の局面への指し手。最後の局面では 0
+};
+static_assert(sizeof(HuffmanCodedPosChainEntry) == 6, "");
+
 // やねうら王のpacked sfen
 struct PackedSfen {
 	static const HuffmanCode boardCodeTable[PieceNone];
 	static const HuffmanCode handCodeTable[HandPieceNum][ColorNum];
-	static HuffmanCodeToPieceHash boardCodeToPieceHash;
-	static HuffmanCodeToPieceHash handCodeToPieceHash;
+	static HuffmanCodeToPiece boardCodeToPieceTable[256];
+	static HuffmanCodeToPiece handCodeToPieceTable[256];
 	static void init() {
+		std::fill(std::begin(boardCodeToPieceTable), std::end(boardCodeToPieceTable), HuffmanCodeToPiece{ PieceNone, 0 });
+		std::fill(std::begin(handCodeToPieceTable), std::end(handCodeToPieceTable), HuffmanCodeToPiece{ PieceNone, 0 });
 		for (Piece pc = Empty; pc <= BDragon; ++pc)
 			if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-				boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+				initHuffmanCodeToPieceTable(boardCodeToPieceTable, boardCodeTable[pc], pc);
 		for (Piece pc = WPawn; pc <= WDragon; ++pc)
 			if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-				boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+				initHuffmanCodeToPieceTable(boardCodeToPieceTable, boardCodeTable[pc], pc);
 		for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
 			for (Color c = Black; c < ColorNum; ++c)
-				handCodeToPieceHash[handCodeTable[hp][c].key] = colorAndPieceTypeToPiece(c, handPieceToPieceType(hp));
+				initHuffmanCodeToPieceTable(handCodeToPieceTable, handCodeTable[hp][c], colorAndPieceTypeToPiece(c, handPieceToPieceType(hp)));
 	}
 	void clear() { std::fill(std::begin(data), std::end(data), 0); }
 
@@ -244,6 +360,22 @@ struct PackedSfenValue
 	// 32 + 2 + 2 + 2 + 1 + 1 = 40bytes
 };
 
+// PackedSfen と HuffmanCodedPos を、Position を経由せずに符号の付け替えだけで相互に変換する。
+// 符号の bit 数は駒の種類毎に同じなので、変換後も 256 bit になる。
+// 持ち駒は、HuffmanCodedPos は toHuffmanCodedPos() と、PackedSfen はやねうら王と同じ順番で書き込む。
+// 事前に HuffmanCodedPos::init() と PackedSfen::init() を呼んでおくこと。不正な符号なら false を返す。
+bool packedSfenToHuffmanCodedPos(const PackedSfen& sfen, HuffmanCodedPos& hcp);
+bool huffmanCodedPosToPackedSfen(const HuffmanCodedPos& hcp, PackedSfen& sfen);
+
+// HuffmanCodedPos と SFEN 文字列を、Position を経由せずに相互に変換する。
+// huffmanCodedPosToSFEN() は buf に Position::toSFEN(ply) と同じ文字列を NULL 終端で書き込み、文字数を返す。
+// buf は MaxSFENLength 文字以上必要。不正な符号なら 0 を返す。
+// sfenToHuffmanCodedPos() は先頭の "sfen " と末尾の手数、改行を省略出来る。
+// 玉が 1 枚ずつでない、駒が揃っておらず 256 bit にならない等の局面は false を返す。
+const int MaxSFENLength = 256;
+int huffmanCodedPosToSFEN(const HuffmanCodedPos& hcp, char* buf, const int ply = 1);
+bool sfenToHuffmanCodedPos(const char* sfen, const size_t len, HuffmanCodedPos& hcp);
+
 class Move;
 struct Thread;
 struct Searcher;
@@ -446,6 +578,9 @@ public:
     bool isOK() const;
 
     static void initZobrist();
+    // Position に復号せずに、hcp の符号を 1 回走査して getKey() と同じ値を計算する。
+    // 不正な符号なら false を返す。
+    static bool getKey(const HuffmanCodedPos& hcp, Key& key);
 
     static Score pieceScore(const Piece pc)            { return PieceScore[pc]; }
     // Piece を index としても、 PieceType を index としても、
@@ -582,6 +717,122 @@ template <> inline Bitboard Position::attacksFrom<King  >(const Color  , const S
 template <> inline Bitboard Position::attacksFrom<Horse >(const Color  , const Square sq) const { return  horseAttack(   sq, occupiedBB()); }
 template <> inline Bitboard Position::attacksFrom<Dragon>(const Color  , const Square sq) const { return dragonAttack(   sq, occupiedBB()); }
 
+// 複数の局面をまとめて HuffmanCodedPos に変換する。
+// 今は toHuffmanCodedPos() を順に呼ぶだけ。局面を生成して符号化するツールはこれを通して呼び、まとめて速くする場合はここを変える。
+// psv_to_hcp は Position を作らずに PackedSfen から直接変換する (packedSfenToHuffmanCodedPos) ので、これは使わない。
+void toHuffmanCodedPosBatch(const Position* positions[], const size_t n, HuffmanCodedPos* hcps);
+
+// 入力特徴量の作成のように、盤面の情報だけが必要なときに使う軽量な局面。
+// Position::set() と異なり、hash key、駒割り、StateInfo は計算しない。
+// 王手している駒は inCheck(), checkersBB() が呼ばれたときに初めて計算する。
+class BoardOnlyPosition {
+public:
+    bool set(const HuffmanCodedPos& hcp) { return set(hcp, [](const Piece, const Square) {}); }
+    // 盤上の駒を 1 つ復号する度に f(pc, sq) を呼ぶ。玉も含む。
+    // f が呼ばれる時点で turn() は確定している。
+    template <typename F> bool set(const HuffmanCodedPos& hcp, F f);
+
+    Bitboard bbOf(const PieceType pt) const                { return byTypeBB_[pt]; }
+    Bitboard bbOf(const Color c) const                     { return byColorBB_[c]; }
+    Bitboard bbOf(const PieceType pt, const Color c) const { return bbOf(pt) & bbOf(c); }
+    Bitboard occupiedBB() const { return bbOf(Occupied); }
+
+    Piece piece(const Square sq) const { return piece_[sq]; }
+    Hand hand(const Color c) const { return hand_[c]; }
+    Color turn() const { return turn_; }
+    Square kingSquare(const Color c) const { return kingSquare_[c]; }
+
+    Bitboard checkersBB() const {
+        if (!checkersComputed_) {
+            checkersBB_ = computeCheckers();
+            checkersComputed_ = true;
+        }
+        return checkersBB_;
+    }
+    bool inCheck() const { return checkersBB().isAny(); }
+
+private:
+    void clear() {
+        std::fill(std::begin(byTypeBB_), std::end(byTypeBB_), allZeroBB());
+        std::fill(std::begin(byColorBB_), std::end(byColorBB_), allZeroBB());
+        std::fill(std::begin(piece_), std::end(piece_), Empty);
+        kingSquare_[Black] = kingSquare_[White] = SQ11;
+        hand_[Black] = hand_[White] = Hand(0);
+        turn_ = Black;
+        checkersBB_ = allZeroBB();
+        checkersComputed_ = false;
+    }
+    void setPiece(const Piece piece, const Square sq) {
+        const Color c = pieceToColor(piece);
+        const PieceType pt = pieceToPieceType(piece);
+
+        piece_[sq] = piece;
+
+        byTypeBB_[pt].setBit(sq);
+        byColorBB_[c].setBit(sq);
+        byTypeBB_[Occupied].setBit(sq);
+    }
+    // 手番側の玉へ check している駒を全て探す。Position::findCheckers() と同じ。
+    Bitboard computeCheckers() const;
+
+    Bitboard byTypeBB_[PieceTypeNum];
+    Bitboard byColorBB_[ColorNum];
+    Piece piece_[SquareNum];
+    Square kingSquare_[ColorNum];
+    Hand hand_[ColorNum];
+    Color turn_;
+
+    mutable Bitboard checkersBB_;
+    mutable bool checkersComputed_;
+};
+
+template <typename F> bool BoardOnlyPosition::set(const HuffmanCodedPos& hcp, F f) {
+    clear();
+
+    BitStream64 bs(hcp.data);
+
+    // 手番
+    turn_ = static_cast<Color>(bs.getBit());
+
+    // 玉の位置
+    kingSquare_[Black] = static_cast<Square>(bs.getBits(7));
+    kingSquare_[White] = static_cast<Square>(bs.getBits(7));
+    if (kingSquare_[Black] >= SquareNum || kingSquare_[White] >= SquareNum || kingSquare_[Black] == kingSquare_[White])
+        goto INCORRECT_HUFFMAN_CODE;
+    setPiece(BKing, kingSquare_[Black]);
+    setPiece(WKing, kingSquare_[White]);
+    f(BKing, kingSquare_[Black]);
+    f(WKing, kingSquare_[White]);
+
+    // 盤上の駒
+    for (Square sq = SQ11; sq < SquareNum; ++sq) {
+        if (pieceToPieceType(piece(sq)) == King) // piece(sq) は BKing, WKing, Empty のどれか。
+            continue;
+        if (bs.end())
+            goto INCORRECT_HUFFMAN_CODE;
+        const Piece pc = bs.getPiece(HuffmanCodedPos::boardCodeToPieceTable);
+        if (pc == PieceNone)
+            goto INCORRECT_HUFFMAN_CODE;
+        if (pc != Empty) {
+            setPiece(pc, sq);
+            f(pc, sq);
+        }
+    }
+    while (!bs.end()) {
+        const Piece pc = bs.getPiece(HuffmanCodedPos::handCodeToPieceTable);
+        if (pc == PieceNone)
+            goto INCORRECT_HUFFMAN_CODE;
+        hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
+    }
+    if (bs.curr() != 256)
+        goto INCORRECT_HUFFMAN_CODE;
+
+    return true;
+INCORRECT_HUFFMAN_CODE:
+    std::cout << "incorrect Huffman code." << std::endl;
+    return false;
+}
+
 // position sfen R8/2K1S1SSk/4B4/9/9/9/9/9/1L1L1L3 b PLNSGBR17p3n3g 1
 // の局面が最大合法手局面で 593 手。番兵の分、+ 1 しておく。
 const int MaxLegalMoves = 593 + 1;
@@ -0,0 +1,165 @@
+﻿#ifndef HCP_DECODER_SHARD_READER_HPP
+#define HCP_DECODER_SHARD_READER_HPP
+
+// 複数のシャード (hcp, hcpe, hcphe ファイル) から、シャッフルバッファを通してランダムな順番でレコードを読む。
+//
+// ランダムに選んだシャードから chunk_size 件ずつ連続した領域を読み、buffer_size 件のバッファに追加する。
+// レコードはバッファからランダムに選んで取り出し、空いた位置にはバッファの末尾のレコードを移す。
+// ディスクからは大きな単位で順に読むだけなので、シャッフル済みのファイルを毎エポック作り直す必要がない。
+//
+// シャードは残りのレコード数に比例する確率で選ぶので、どのシャードも同じような速さで読み進む。
+// 各シャードはエポック毎にランダムな位置から読み始めて先頭に戻るので、チャンクの区切りもエポック毎に変わる。
+// buffer_size を大きくするほど混ざり方は一様な順列に近づき、メモリ使用量は buffer_size * record_size バイトになる。
+// chunk_size を大きくするほど読み込みは速くなるが、同じチャンクのレコードが近い位置に出やすくなる。
+// 1 エポックで全シャードの全レコードをちょうど 1 回ずつ返す。乱数はシードとエポック番号から決まる。
+//
+// シャードのファイルは開いたままにして続きを読む。ただし、同時に開くのは MaxOpenShards 個までとし、
+// それを超えるときは最も長く読んでいないシャードを閉じる。
+// スレッドセーフではない。複数のスレッドから使う場合は呼び出し側でロックすること。
+
+#include "shuffle.hpp"
+
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+class ShardShuffleReader {
+public:
+	// record_size : 1 レコードのバイト数。ファイル末尾の record_size に満たない端数は読まない。
+	ShardShuffleReader(const std::vector<std::string>& paths, const size_t recordSize, const s64 bufferSize, const s64 chunkSize, const u64 seed)
+		: recordSize_(recordSize), bufferSize_(bufferSize), chunkSize_(chunkSize), seed_(seed), random_(seed, ShardReaderStream, 0)
+	{
+		if (recordSize == 0 || chunkSize <= 0 || bufferSize < chunkSize)
+			throw std::invalid_argument("record_size and chunk_size must be positive, buffer_size must be at least chunk_size");
+		shards_.resize(paths.size());
+		for (size_t s = 0; s < paths.size(); s++) {
+			Shard& shard = shards_[s];
+			shard.path = paths[s];
+			std::ifstream& ifs = open(shard);
+			ifs.seekg(0, std::ios::end);
+			shard.size = (s64)ifs.tellg() / (s64)recordSize;
+			totalSize_ += shard.size;
+		}
+		buffer_.reset(new char[bufferSize * recordSize]);
+		startEpoch(0);
+	}
+
+	// epoch 番目のエポックを最初から読み直す。
+	void startEpoch(const u64 epoch) {
+		epoch_ = epoch;
+		random_ = ShuffleRandom(seed_, ShardReaderStream, epoch);
+		remaining_ = totalSize_;
+		for (auto& shard : shards_) {
+			shard.start = (shard.size == 0 ? 0 : (s64)random_.bounded(shard.size));
+			shard.read = 0;
+		}
+		count_ = 0;
+	}
+	void nextEpoch() { startEpoch(epoch_ + 1); }
+
+	// 最大 num 件のレコードを dst に書き込み、書き込んだ件数を返す。エポックの残りが num 件未満なら残り全てを返す。
+	s64 read(void* dst, const s64 num) {
+		char* out = static_cast<char*>(dst);
+		s64 n = 0;
+		for (; n < num; n++, out += recordSize_) {
+			// バッファを満たしてから取り出し始め、以後は chunk_size 件空く毎に補充する。
+			while (remaining_ > 0 && count_ + std::min(chunkSize_, remaining_) <= bufferSize_)
+				fill();
+			if (count_ == 0)
+				break;
+			const s64 i = (s64)random_.bounded(count_);
+			char* record = buffer_.get() + i * recordSize_;
+			std::memcpy(out, record, recordSize_);
+			if (i != --count_)
+				std::memcpy(record, buffer_.get() + count_ * recordSize_, recordSize_);
+		}
+		return n;
+	}
+
+	size_t recordSize() const { return recordSize_; }
+	s64 size() const { return totalSize_; } // 全シャードのレコード数
+	s64 shardNum() const { return (s64)shards_.size(); }
+	u64 epoch() const { return epoch_; }
+	// 現在のエポックでまだ返していないレコード数
+	s64 left() const { return remaining_ + count_; }
+
+private:
+	static const u32 ShardReaderStream = 3; // ShuffleRandom の用途。shuffle.hpp のツールと重ならない値にする。
+	// 同時に開くシャードの数の上限。MSVC の stdio の既定の上限 (512) やファイルディスクリプタの上限より十分小さくする。
+	static const int MaxOpenShards = 128;
+
+	struct Shard {
+		std::string path;
+		s64 size = 0;
+		s64 start = 0; // このエポックで最初に読む位置
+		s64 read = 0; // このエポックで読んだレコード数
+		std::unique_ptr<std::ifstream> ifs; // 開いていなければ nullptr
+		u64 lastUse = 0; // 最後に読んだときの useCount_
+	};
+
+	// shard のファイルを開いたままにして返す。開いているシャードが多すぎれば、最も長く読んでいないものを閉じる。
+	std::ifstream& open(Shard& shard) {
+		shard.lastUse = ++useCount_;
+		if (shard.ifs)
+			return *shard.ifs;
+		if (openNum_ == MaxOpenShards) {
+			Shard* oldest = nullptr;
+			for (auto& other : shards_) {
+				if (other.ifs && (oldest == nullptr || other.lastUse < oldest->lastUse))
+					oldest = &other;
+			}
+			oldest->ifs.reset();
+			openNum_--;
+		}
+		shard.ifs.reset(new std::ifstream(shard.path, std::ios::binary));
+		if (!*shard.ifs) {
+			shard.ifs.reset();
+			throw std::runtime_error("cannot open " + shard.path);
+		}
+		openNum_++;
+		return *shard.ifs;
+	}
+
+	// 残りのレコード数に比例する確率でシャードを選び、続きの最大 chunk_size 件をバッファの末尾に読む。
+	void fill() {
+		s64 r = (s64)random_.bounded(remaining_);
+		size_t s = 0;
+		while (r >= shards_[s].size - shards_[s].read) {
+			r -= shards_[s].size - shards_[s].read;
+			s++;
+		}
+		Shard& shard = shards_[s];
+		const s64 pos = (shard.start + shard.read) % shard.size;
+		// 末尾に達したら先頭に戻るので、1 回に読むのは末尾までにする。
+		const s64 num = std::min(std::min(chunkSize_, shard.size - shard.read), shard.size - pos);
+
+		std::ifstream& ifs = open(shard);
+		// 前回の続きなら seekg は不要だが、先頭に戻るときや開き直したときのために常に位置を合わせる。
+		ifs.seekg(pos * (s64)recordSize_);
+		ifs.read(buffer_.get() + count_ * recordSize_, num * recordSize_);
+		if (!ifs) {
+			shard.ifs.reset();
+			openNum_--;
+			throw std::runtime_error("cannot read " + shard.path);
+		}
+		shard.read += num;
+		remaining_ -= num;
+		count_ += num;
+	}
+
+	const size_t recordSize_;
+	const s64 bufferSize_;
+	const s64 chunkSize_;
+	const u64 seed_;
+	std::vector<Shard> shards_;
+	s64 totalSize_ = 0;
+	u64 epoch_ = 0;
+	s64 remaining_ = 0; // このエポックでまだシャードから読んでいないレコード数
+	std::unique_ptr<char[]> buffer_;
+	s64 count_ = 0; // バッファ内のレコード数
+	ShuffleRandom random_;
+	int openNum_ = 0; // 開いているシャードの数
+	u64 useCount_ = 0;
+};
+
+#endif // #ifndef HCP_DECODER_SHARD_READER_HPP
@@ -0,0 +1,684 @@
+﻿#ifndef HCP_DECODER_SHUFFLE_HPP
+#define HCP_DECODER_SHUFFLE_HPP
+
+// hcpe_shuffle, hcphe_shuffle の共通部分。
+//
+// 入力ファイルを 1 回だけ先頭から読み、各レコードを一様ランダムに選んだ一時ファイル (バケット) に振り分ける。
+// その後、バケット毎にメモリ上でシャッフルし、バケットの順に連結したものを num_per_file 件ずつ出力ファイルに書き出す。
+// バケットを一様に選び、バケット内を一様にシャッフルして連結すると、全体も一様なランダム順列になる。
+// 読み込みは入力ファイル 1 回分、一時ファイルの書き込みと読み込みが 1 回分で、出力ファイル数に依らない。
+// メモリ使用量は概ね max_memory に収まる。一時ファイルは入力ファイルと同じディレクトリに作り、使い終わったら削除する。
+// 一時ファイルは書き込みバッファが一杯になる度に追記モードで開いて閉じるので、同時に開くファイルは 1 つだけで、
+// バケット数はファイルディスクリプタやストリームの上限に制限されない。
+//
+// --cipher を指定すると、鍵付きの [0, N) 上の全単射 (FeistelPermutation) で出力位置から入力位置を計算し、
+// 一時ファイルを使わずに出力ファイルを 1 つずつ作る。出力ファイル毎に独立に作れて、メモリ使用量は N に依らない。
+// 入力はとびとびの位置を読むので、読み込み量はバケットを使うより多い。
+//
+// 乱数は全てシードから決まり、シードと完成した出力ファイルを manifest ファイル (infile + ".manifest") に記録する。
+// 中断したシャッフルを同じ引数で再実行すると、manifest のシードを使い、検証の済んだ出力ファイルを作り直さない。
+
+#include "common.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+struct ShuffleOptions {
+	std::string infile;
+	s64 num_per_file;
+	s64 max_memory = 4096LL * 1024 * 1024; // バイト
+	bool cipher = false;
+	bool hasSeed = false;
+	u64 seed = 0;
+};
+
+// infile num_per_file [--max-memory MB] [--cipher] [--seed N] を解析する。不正な引数なら usage を表示して false を返す。
+inline bool parseShuffleOptions(int argc, char** argv, ShuffleOptions& options) {
+	std::vector<char*> positional;
+	bool ok = true;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc)
+			options.max_memory = std::atoll(argv[++i]) * 1024 * 1024;
+		else if (strcmp(argv[i], "--cipher") == 0)
+			options.cipher = true;
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			options.seed = std::strtoull(argv[++i], nullptr, 10);
+			options.hasSeed = true;
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+			ok = false;
+		else
+			positional.push_back(argv[i]);
+	}
+	// 3 番目の引数は以前の分割数 (divNum)。使わないが、既存のスクリプトのために受け付ける。
+	ok = ok && (positional.size() == 2 || positional.size() == 3) && std::atoll(positional[1]) > 0 && options.max_memory > 0;
+	if (!ok) {
+		std::cout << argv[0] << " infile num_per_file [--max-memory MB] [--cipher] [--seed N]" << std::endl;
+		return false;
+	}
+	options.infile = positional[0];
+	options.num_per_file = std::atoll(positional[1]);
+	return true;
+}
+
+inline std::string shuffleOutputFileName(const std::string& infile, const s64 i) {
+	std::ostringstream sout;
+	sout << infile << "-" << std::setfill('0') << std::setw(2) << i + 1;
+	return sout.str();
+}
+
+// シードと (用途, 番号) から決まる乱数列。
+// 標準ライブラリの実装に依らず同じ結果になるように、std::uniform_int_distribution, std::shuffle は使わない。
+class ShuffleRandom {
+public:
+	ShuffleRandom(const u64 seed, const u32 stream, const u64 index) {
+		std::seed_seq seq{ (u32)seed, (u32)(seed >> 32), stream, (u32)index, (u32)(index >> 32) };
+		engine_.seed(seq);
+	}
+	u64 next() { return engine_(); }
+	// [0, 2^bits) の一様乱数
+	u64 bits(const int bits) {
+		return (bits == 0 ? 0 : engine_() >> (64 - bits));
+	}
+	// [0, n) の一様乱数。n < 2^32 なら除算を避ける (Lemire の方法)。
+	u64 bounded(const u64 n) {
+		if (n <= 0xffffffffULL) {
+			u64 m = (engine_() >> 32) * n;
+			if ((u32)m < n) {
+				const u32 threshold = (u32)(0 - n) % (u32)n;
+				while ((u32)m < threshold)
+					m = (engine_() >> 32) * n;
+			}
+			return m >> 32;
+		}
+		const u64 threshold = (0 - n) % n;
+		u64 r;
+		do {
+			r = engine_();
+		} while (r < threshold);
+		return r % n;
+	}
+
+private:
+	std::mt19937_64 engine_;
+};
+
+// Fisher-Yates
+template <typename T>
+void shuffleRecords(T* records, const s64 num, ShuffleRandom& random) {
+	for (s64 i = num - 1; i > 0; i--)
+		std::swap(records[i], records[random.bounded(i + 1)]);
+}
+
+// 出力ファイルの検証に使う FNV-1a。続きから計算できるように、途中の値を hash に渡す。
+const u64 ShuffleChecksumBasis = 14695981039346656037ULL;
+inline u64 shuffleChecksum(const void* data, const size_t size, u64 hash = ShuffleChecksumBasis) {
+	const u8* p = static_cast<const u8*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// シャッフルを再開、再現するための manifest ファイル。1 行に 1 項目を書く。
+//   key value           : シャッフルの結果を決めるパラメータ (setParam)
+//   seed N              : シード
+//   state key value     : 途中の状態 (setState)
+//   shard i bytes hash  : 完成した出力ファイル (markDone)
+// 再実行時に、パラメータが全て一致し、--seed を指定しないか manifest と同じシードなら、状態と完成した出力ファイルを引き継ぐ。
+// 一致しなければ新しいシードで最初からやり直す。
+class ShuffleManifest {
+public:
+	ShuffleManifest(const std::string& path, std::function<std::string(s64)> shardFileName)
+		: path_(path), shardFileName_(shardFileName) {}
+
+	template <typename V>
+	void setParam(const std::string& key, const V& value) {
+		std::ostringstream sout;
+		sout << value;
+		params_.emplace_back(key, sout.str());
+	}
+
+	// 既存の manifest を読み、引き継ぐかどうかを決めて書き直す。書き込めなければ false を返す。
+	bool open(const bool hasSeed, const u64 seed) {
+		std::vector<std::pair<std::string, std::string> > params;
+		bool hasOldSeed = false;
+		u64 oldSeed = 0;
+		std::map<s64, std::pair<s64, u64> > shards;
+		std::map<std::string, std::string> states;
+		std::ifstream ifs(path_);
+		const bool exists = (bool)ifs;
+		for (std::string line; std::getline(ifs, line); ) {
+			std::istringstream ss(line);
+			std::string key;
+			if (!(ss >> key))
+				continue;
+			if (key == "seed")
+				hasOldSeed = (bool)(ss >> oldSeed);
+			else if (key == "shard") {
+				s64 shard, bytes;
+				u64 hash;
+				if (ss >> shard >> bytes >> hash)
+					shards[shard] = std::make_pair(bytes, hash);
+			}
+			else if (key == "state") {
+				std::string name, value;
+				if (ss >> name && std::getline(ss >> std::ws, value))
+					states[name] = value;
+			}
+			else {
+				std::string value;
+				std::getline(ss >> std::ws, value);
+				params.emplace_back(key, value);
+			}
+		}
+		ifs.close();
+
+		if (exists && hasOldSeed && params == params_ && (!hasSeed || seed == oldSeed)) {
+			seed_ = oldSeed;
+			shards_ = shards;
+			states_ = states;
+			std::cout << "resume from " << path_ << " (" << shards_.size() << " shards recorded)" << std::endl;
+		}
+		else {
+			if (exists)
+				std::cout << path_ << " does not match the arguments. start over." << std::endl;
+			if (hasSeed)
+				seed_ = seed;
+			else {
+				std::random_device seed_gen;
+				seed_ = ((u64)seed_gen() << 32) | seed_gen();
+			}
+		}
+		std::cout << "seed = " << seed_ << std::endl;
+		return rewrite();
+	}
+
+	u64 seed() const { return seed_; }
+	std::string shardFileName(const s64 shard) const { return shardFileName_(shard); }
+
+	// 出力ファイル shard が記録されていて、大きさとチェックサムが記録と一致すれば true
+	bool isDone(const s64 shard) const {
+		const auto it = shards_.find(shard);
+		if (it == shards_.end())
+			return false;
+		std::ifstream ifs(shardFileName(shard), std::ifstream::in | std::ifstream::binary | std::ios::ate);
+		if (!ifs || (s64)ifs.tellg() != it->second.first)
+			return false;
+		ifs.seekg(0);
+		std::vector<char> buf(4 * 1024 * 1024);
+		u64 hash = ShuffleChecksumBasis;
+		for (s64 rest = it->second.first; rest > 0; ) {
+			const s64 size = std::min<s64>(rest, buf.size());
+			if (!ifs.read(buf.data(), size))
+				return false;
+			hash = shuffleChecksum(buf.data(), size, hash);
+			rest -= size;
+		}
+		return hash == it->second.second;
+	}
+	bool markDone(const s64 shard, const s64 bytes, const u64 hash) {
+		shards_[shard] = std::make_pair(bytes, hash);
+		std::ostringstream sout;
+		sout << "shard " << shard << " " << bytes << " " << hash;
+		return append(sout.str());
+	}
+
+	// 記録されていなければ空文字列を返す。
+	std::string state(const std::string& name) const {
+		const auto it = states_.find(name);
+		return (it == states_.end() ? std::string() : it->second);
+	}
+	bool setState(const std::string& name, const std::string& value) {
+		states_[name] = value;
+		return append("state " + name + " " + value);
+	}
+
+private:
+	bool append(const std::string& line) {
+		std::ofstream ofs(path_, std::ios::app);
+		ofs << line << '\n';
+		ofs.flush();
+		if (!ofs)
+			std::cerr << "Error: cannot write " << path_ << std::endl;
+		return (bool)ofs;
+	}
+	// 一時ファイルに書いてから置き換える。
+	bool rewrite() {
+		const std::string tmp = path_ + ".tmp";
+		{
+			std::ofstream ofs(tmp);
+			for (const auto& param : params_)
+				ofs << param.first << " " << param.second << '\n';
+			ofs << "seed " << seed_ << '\n';
+			for (const auto& state : states_)
+				ofs << "state " << state.first << " " << state.second << '\n';
+			for (const auto& shard : shards_)
+				ofs << "shard " << shard.first << " " << shard.second.first << " " << shard.second.second << '\n';
+			ofs.flush();
+			if (!ofs) {
+				std::cerr << "Error: cannot write " << tmp << std::endl;
+				return false;
+			}
+		}
+		std::remove(path_.c_str());
+		if (std::rename(tmp.c_str(), path_.c_str()) != 0) {
+			std::cerr << "Error: cannot rename " << tmp << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	const std::string path_;
+	const std::function<std::string(s64)> shardFileName_;
+	std::vector<std::pair<std::string, std::string> > params_;
+	u64 seed_ = 0;
+	std::map<s64, std::pair<s64, u64> > shards_;
+	std::map<std::string, std::string> states_;
+};
+
+// 出力ファイル毎に、manifest で完成が確認できたかを返す。
+inline std::vector<char> shuffleDoneShards(const ShuffleManifest& manifest, const s64 fileNum) {
+	std::vector<char> done(fileNum);
+	s64 doneNum = 0;
+	for (s64 i = 0; i < fileNum; i++)
+		doneNum += done[i] = manifest.isDone(i);
+	if (doneNum > 0)
+		std::cout << doneNum << " / " << fileNum << " shards are already done" << std::endl;
+	return done;
+}
+
+// シャッフルした順にレコードを受け取り、num_per_file 件ずつ出力ファイルに書き出す。
+// 完成済みの出力ファイルの分は読み捨てる。出力ファイルが完成する度に done と manifest に記録する。
+template <typename T>
+class ShuffleOutput {
+public:
+	ShuffleOutput(const ShuffleOptions& options, const s64 entryNum, ShuffleManifest& manifest, std::vector<char>& done)
+		: options_(options), entryNum_(entryNum), manifest_(manifest), done_(done) {}
+
+	bool write(const T* records, s64 num) {
+		while (num > 0) {
+			const s64 shard = position_ / options_.num_per_file;
+			const s64 shardEnd = std::min(entryNum_, options_.num_per_file * (shard + 1));
+			const s64 n = std::min(num, shardEnd - position_);
+			if (!done_[shard]) {
+				const std::string outfile = manifest_.shardFileName(shard);
+				if (!ofs_.is_open()) {
+					ofs_.open(outfile, std::ios::binary);
+					if (!ofs_) {
+						std::cerr << "Error: cannot open " << outfile << std::endl;
+						return false;
+					}
+					std::cout << shardEnd - options_.num_per_file * shard << std::endl;
+					hash_ = ShuffleChecksumBasis;
+				}
+				ofs_.write(reinterpret_cast<const char*>(records), sizeof(T) * n);
+				hash_ = shuffleChecksum(records, sizeof(T) * n, hash_);
+				if (position_ + n == shardEnd)
+					ofs_.close();
+				if (!ofs_) {
+					std::cerr << "Error: cannot write " << outfile << std::endl;
+					return false;
+				}
+				if (position_ + n == shardEnd) {
+					done_[shard] = 1;
+					if (!manifest_.markDone(shard, sizeof(T) * (shardEnd - options_.num_per_file * shard), hash_))
+						return false;
+				}
+			}
+			records += n;
+			num -= n;
+			position_ += n;
+		}
+		return true;
+	}
+	// 完成済みの出力ファイルにしか入らない num 件を読み飛ばす。
+	void skip(const s64 num) { position_ += num; }
+
+private:
+	const ShuffleOptions& options_;
+	const s64 entryNum_;
+	ShuffleManifest& manifest_;
+	std::vector<char>& done_;
+	std::ofstream ofs_;
+	s64 position_ = 0; // 次のレコードの出力位置
+	u64 hash_ = 0;
+};
+
+template <typename T>
+int externalShuffle(const ShuffleOptions& options) {
+	std::ifstream ifs(options.infile, std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << options.infile << std::endl;
+		return 1;
+	}
+	const s64 entryNum = ifs.tellg() / sizeof(T);
+	ifs.seekg(0);
+
+	std::cout << entryNum << std::endl;
+
+	// メモリ上でシャッフルできるレコード数
+	const s64 capacity = std::max<s64>(1, options.max_memory / sizeof(T));
+	// 全て読めるなら一時ファイルは使わない。
+	// そうでなければ、バケットの大きさの期待値を capacity の 9 割にして、ばらつきで capacity を超えないようにする。
+	const s64 bucketNum = (entryNum <= capacity ? 1 : (entryNum + capacity * 9 / 10 - 1) / (capacity * 9 / 10));
+	const s64 fileNum = (entryNum + options.num_per_file - 1) / options.num_per_file;
+
+	ShuffleManifest manifest(options.infile + ".manifest", [&](const s64 i) { return shuffleOutputFileName(options.infile, i); });
+	manifest.setParam("mode", "bucket");
+	manifest.setParam("record_size", sizeof(T));
+	manifest.setParam("entry_num", entryNum);
+	manifest.setParam("num_per_file", options.num_per_file);
+	manifest.setParam("bucket_num", bucketNum);
+	if (!manifest.open(options.hasSeed, options.seed))
+		return 1;
+	std::vector<char> done = shuffleDoneShards(manifest, fileNum);
+	ShuffleOutput<T> output(options, entryNum, manifest, done);
+
+	std::vector<std::string> bucketFiles(bucketNum);
+	for (s64 b = 0; b < bucketNum; b++) {
+		std::ostringstream sout;
+		sout << options.infile << ".tmp" << std::setfill('0') << std::setw(4) << b;
+		bucketFiles[b] = sout.str();
+	}
+
+	if (std::count(done.begin(), done.end(), 1) == fileNum) {
+		if (bucketNum > 1) {
+			for (const auto& file : bucketFiles)
+				std::remove(file.c_str());
+		}
+		return 0;
+	}
+
+	if (bucketNum == 1) {
+		std::vector<T> records(entryNum);
+		ifs.read(reinterpret_cast<char*>(records.data()), sizeof(T) * entryNum);
+		ShuffleRandom random(manifest.seed(), 1, 0);
+		shuffleRecords(records.data(), entryNum, random);
+		return output.write(records.data(), entryNum) ? 0 : 1;
+	}
+
+	// バケット b は、出力位置 [bucketBegin[b], bucketBegin[b + 1]) になる。
+	std::vector<s64> bucketBegin(bucketNum + 1);
+	// バケットに未完成の出力ファイルの分が含まれるか
+	auto needed = [&](const s64 b) {
+		if (bucketBegin[b] == bucketBegin[b + 1])
+			return false;
+		for (s64 shard = bucketBegin[b] / options.num_per_file; shard <= (bucketBegin[b + 1] - 1) / options.num_per_file; shard++) {
+			if (!done[shard])
+				return true;
+		}
+		return false;
+	};
+	auto bucketFileSize = [&](const s64 b) {
+		std::ifstream bucket(bucketFiles[b], std::ifstream::in | std::ifstream::binary | std::ios::ate);
+		return (bucket ? (s64)bucket.tellg() : (s64)-1);
+	};
+
+	// 前回の振り分けが完了していて、必要な一時ファイルが残っていれば、振り分けを省く。
+	bool scattered = false;
+	{
+		std::istringstream ss(manifest.state("buckets"));
+		s64 sum = 0;
+		s64 b = 0;
+		for (s64 size; b < bucketNum && ss >> size; b++) {
+			bucketBegin[b] = sum;
+			sum += size;
+		}
+		bucketBegin[bucketNum] = sum;
+		scattered = (b == bucketNum && sum == entryNum);
+		for (b = 0; scattered && b < bucketNum; b++)
+			scattered = !needed(b) || bucketFileSize(b) == (s64)sizeof(T) * (bucketBegin[b + 1] - bucketBegin[b]);
+	}
+
+	// 1. 入力を先頭から読み、バケットに振り分ける。
+	// メモリの半分を読み込みバッファに、残りを各バケットの書き込みバッファに使う。
+	if (!scattered) {
+		std::cout << "bucket num = " << bucketNum << std::endl;
+		// 書き込みバッファが小さいと、一時ファイルを開き直す回数が多くなりすぎるので、始める前に止める。
+		const s64 minBufferSize = 64 * 1024;
+		if (options.max_memory / 2 / bucketNum < minBufferSize) {
+			const double required = std::sqrt(2.0 * minBufferSize * sizeof(T) * entryNum / 0.9);
+			std::cerr << "Error: --max-memory is too small for " << entryNum << " records (" << bucketNum << " buckets). Use at least "
+				<< (s64)std::ceil(required / (1024 * 1024)) + 1 << " MB." << std::endl;
+			return 1;
+		}
+		const s64 readNum = std::max<s64>(1, std::min<s64>(options.max_memory / 2, 64 * 1024 * 1024) / sizeof(T));
+		const s64 bufferNum = std::max<s64>(1, std::min<s64>(options.max_memory / 2 / bucketNum, 4 * 1024 * 1024) / sizeof(T));
+		std::vector<T> inrecords(readNum);
+		std::vector<std::vector<T> > buffers(bucketNum);
+		std::vector<s64> sizes(bucketNum);
+		for (s64 b = 0; b < bucketNum; b++) {
+			buffers[b].reserve(bufferNum);
+			// 前回の途中までの一時ファイルを空にする。
+			std::ofstream ofs(bucketFiles[b], std::ios::binary | std::ios::trunc);
+			if (!ofs) {
+				std::cerr << "Error: cannot open " << bucketFiles[b] << std::endl;
+				return 1;
+			}
+		}
+		auto flush = [&](const s64 b) {
+			if (buffers[b].empty())
+				return true;
+			std::ofstream ofs(bucketFiles[b], std::ios::binary | std::ios::app);
+			ofs.write(reinterpret_cast<const char*>(buffers[b].data()), sizeof(T) * buffers[b].size());
+			ofs.close();
+			buffers[b].clear();
+			if (!ofs)
+				std::cerr << "Error: cannot write " << bucketFiles[b] << std::endl;
+			return (bool)ofs;
+		};
+
+		ShuffleRandom random(manifest.seed(), 0, 0);
+		for (s64 i = 0; i < entryNum; i += readNum) {
+			const s64 num = std::min(readNum, entryNum - i);
+			ifs.read(reinterpret_cast<char*>(inrecords.data()), sizeof(T) * num);
+			if (!ifs) {
+				std::cerr << "Error: cannot read " << options.infile << std::endl;
+				return 1;
+			}
+			for (s64 j = 0; j < num; j++) {
+				const s64 b = random.bounded(bucketNum);
+				buffers[b].push_back(inrecords[j]);
+				sizes[b]++;
+				if ((s64)buffers[b].size() == bufferNum && !flush(b))
+					return 1;
+			}
+		}
+		std::ostringstream sout;
+		for (s64 b = 0; b < bucketNum; b++) {
+			if (!flush(b))
+				return 1;
+			bucketBegin[b + 1] = bucketBegin[b] + sizes[b];
+			sout << (b > 0 ? " " : "") << sizes[b];
+		}
+		if (!manifest.setState("buckets", sout.str()))
+			return 1;
+	}
+	ifs.close();
+
+	// 2. バケット毎にシャッフルして、順に出力する。
+	// 一時ファイルは、含まれる出力ファイルが全て完成してから削除する。
+	std::vector<T> records;
+	s64 removed = 0; // [0, removed) のバケットの一時ファイルは削除済み
+	for (s64 b = 0; b < bucketNum; b++) {
+		const s64 num = bucketBegin[b + 1] - bucketBegin[b];
+		if (!needed(b))
+			output.skip(num);
+		else {
+			if (num > capacity) {
+				std::cerr << "Error: bucket " << b << " has " << num << " records, which exceeds --max-memory" << std::endl;
+				return 1;
+			}
+			std::ifstream bucket(bucketFiles[b], std::ifstream::in | std::ifstream::binary);
+			records.resize(num);
+			bucket.read(reinterpret_cast<char*>(records.data()), sizeof(T) * num);
+			if (!bucket) {
+				std::cerr << "Error: cannot read " << bucketFiles[b] << std::endl;
+				return 1;
+			}
+			bucket.close();
+
+			ShuffleRandom random(manifest.seed(), 1, b);
+			shuffleRecords(records.data(), num, random);
+			if (!output.write(records.data(), num))
+				return 1;
+		}
+		for (; removed <= b && !needed(removed); removed++)
+			std::remove(bucketFiles[removed].c_str());
+	}
+	for (; removed < bucketNum; removed++)
+		std::remove(bucketFiles[removed].c_str());
+
+	return 0;
+}
+
+// [0, n) 上の鍵付きの全単射。
+// n 以上の最小の 4^k の範囲で平衡 Feistel 暗号を使い、結果が n 以上なら n 未満になるまで暗号化を繰り返す (cycle-walking)。
+// 4^k < 4n なので、繰り返しの回数の期待値は 4 回未満。
+// 全ての順列から一様に選ぶわけではないが、学習データのシャッフルには十分ランダム。
+class FeistelPermutation {
+public:
+	FeistelPermutation(const u64 n, ShuffleRandom& random) : n_(n) {
+		while ((1ULL << (2 * halfBits_)) < n_)
+			halfBits_++;
+		mask_ = (1ULL << halfBits_) - 1;
+		for (auto& key : keys_)
+			key = random.next();
+	}
+
+	u64 operator () (u64 x) const {
+		assert(x < n_);
+		do {
+			x = encrypt(x);
+		} while (x >= n_);
+		return x;
+	}
+
+private:
+	u64 encrypt(const u64 x) const {
+		u64 left = x >> halfBits_;
+		u64 right = x & mask_;
+		for (const u64 key : keys_) {
+			const u64 next = left ^ (round(right ^ key) & mask_);
+			left = right;
+			right = next;
+		}
+		return (left << halfBits_) | right;
+	}
+	// splitmix64 の最終段
+	static u64 round(u64 z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	static const int RoundNum = 8;
+	const u64 n_;
+	int halfBits_ = 1;
+	u64 mask_;
+	u64 keys_[RoundNum];
+};
+
+// 出力ファイル fileIndex を perm から作り、チェックサムを hash に返す。
+// 出力位置の範囲を max_memory に収まる大きさに区切り、区切り毎に入力位置の順に並べ替えて読み込む。
+template <typename T>
+bool cipherShuffleFile(const ShuffleOptions& options, std::ifstream& ifs, const s64 entryNum, const FeistelPermutation& perm, const s64 fileIndex, u64& hash) {
+	const s64 begin = options.num_per_file * fileIndex;
+	const s64 end = std::min(entryNum, begin + options.num_per_file);
+	const std::string outfile = shuffleOutputFileName(options.infile, fileIndex);
+	std::ofstream ofs(outfile, std::ios::binary);
+	if (!ofs) {
+		std::cerr << "Error: cannot open " << outfile << std::endl;
+		return false;
+	}
+	std::cout << end - begin << std::endl;
+
+	// 入力位置の差がこれより小さければ、間も含めて 1 回で読む。
+	const s64 gapNum = std::max<s64>(1, 64 * 1024 / sizeof(T));
+	const s64 windowNum = std::max<s64>(1, 1024 * 1024 / sizeof(T));
+	const s64 chunkNum = std::max<s64>(1, (options.max_memory - sizeof(T) * windowNum) / (sizeof(T) + sizeof(std::pair<s64, s64>)));
+	std::vector<std::pair<s64, s64> > sources; // (入力位置, 出力位置 - chunkBegin)
+	std::vector<T> records;
+	std::vector<T> window(windowNum);
+	hash = ShuffleChecksumBasis;
+	for (s64 chunkBegin = begin; chunkBegin < end; chunkBegin += chunkNum) {
+		const s64 num = std::min(chunkNum, end - chunkBegin);
+		sources.resize(num);
+		records.resize(num);
+		for (s64 j = 0; j < num; j++)
+			sources[j] = std::make_pair((s64)perm(chunkBegin + j), j);
+		std::sort(sources.begin(), sources.end());
+
+		for (s64 i = 0; i < num; ) {
+			const s64 first = sources[i].first;
+			s64 e = i + 1;
+			while (e < num && sources[e].first - sources[e - 1].first < gapNum && sources[e].first - first < windowNum)
+				e++;
+			ifs.seekg(sizeof(T) * first);
+			ifs.read(reinterpret_cast<char*>(window.data()), sizeof(T) * (sources[e - 1].first - first + 1));
+			if (!ifs) {
+				std::cerr << "Error: cannot read " << options.infile << std::endl;
+				return false;
+			}
+			for (; i < e; i++)
+				records[sources[i].second] = window[sources[i].first - first];
+		}
+
+		ofs.write(reinterpret_cast<const char*>(records.data()), sizeof(T) * num);
+		hash = shuffleChecksum(records.data(), sizeof(T) * num, hash);
+	}
+	ofs.close();
+	if (!ofs) {
+		std::cerr << "Error: cannot write " << outfile << std::endl;
+		return false;
+	}
+	return true;
+}
+
+template <typename T>
+int cipherShuffle(const ShuffleOptions& options) {
+	std::ifstream ifs(options.infile, std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << options.infile << std::endl;
+		return 1;
+	}
+	const s64 entryNum = ifs.tellg() / sizeof(T);
+
+	std::cout << entryNum << std::endl;
+	if (entryNum == 0)
+		return 0;
+
+	ShuffleManifest manifest(options.infile + ".manifest", [&](const s64 i) { return shuffleOutputFileName(options.infile, i); });
+	manifest.setParam("mode", "cipher");
+	manifest.setParam("record_size", sizeof(T));
+	manifest.setParam("entry_num", entryNum);
+	manifest.setParam("num_per_file", options.num_per_file);
+	if (!manifest.open(options.hasSeed, options.seed))
+		return 1;
+	ShuffleRandom random(manifest.seed(), 2, 0);
+	const FeistelPermutation perm(entryNum, random);
+
+	// 出力ファイル毎に独立に作れるので、完成済みのものだけ飛ばす。
+	const s64 fileNum = (entryNum + options.num_per_file - 1) / options.num_per_file;
+	const std::vector<char> done = shuffleDoneShards(manifest, fileNum);
+	for (s64 i = 0; i < fileNum; i++) {
+		if (done[i])
+			continue;
+		u64 hash;
+		if (!cipherShuffleFile<T>(options, ifs, entryNum, perm, i, hash)
+			|| !manifest.markDone(i, sizeof(T) * (std::min(entryNum, options.num_per_file * (i + 1)) - options.num_per_file * i), hash))
+			return 1;
+	}
+	return 0;
+}
+
+template <typename T>
+int shuffleFile(const ShuffleOptions& options) {
+	return options.cipher ? cipherShuffle<T>(options) : externalShuffle<T>(options);
+}
+
+#endif // #ifndef HCP_DECODER_SHUFFLE_HPP
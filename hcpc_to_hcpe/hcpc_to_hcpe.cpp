@@ -0,0 +1,109 @@
+﻿#include "init.hpp"
+#include "position.hpp"
+#include "move.hpp"
+#include <deque>
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		std::cout << "hcpc_to_hcpe hcpcFile hcpeFile" << std::endl;
+		return 0;
+	}
+
+	char* hcpcFile = argv[1];
+	char* hcpeFile = argv[2];
+	const std::string indexFile = std::string(hcpcFile) + ".idx";
+
+	std::ifstream ifs(hcpcFile, std::ifstream::in | std::ifstream::binary);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << hcpcFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// 対局毎の開始位置 (byte)。索引ファイルが無い場合は照合しない。
+	std::vector<u64> index;
+	std::ifstream ifsIndex(indexFile, std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (ifsIndex) {
+		const s64 indexSize = ifsIndex.tellg();
+		if (indexSize % sizeof(u64) != 0) {
+			std::cerr << "Error: broken index file " << indexFile << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		index.resize(indexSize / sizeof(u64));
+		ifsIndex.seekg(0);
+		ifsIndex.read(reinterpret_cast<char*>(index.data()), indexSize);
+	}
+	else {
+		std::cerr << "Warning: " << indexFile << " not found. skip index check." << std::endl;
+	}
+
+	std::ofstream ofs(hcpeFile, std::ios::binary);
+	if (!ofs) {
+		std::cerr << "Error: cannot open " << hcpeFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
+	Position pos;
+	std::deque<StateInfo> states;
+	HuffmanCodedPosChainHeader header;
+	std::vector<HuffmanCodedPosChainEntry> entries;
+	std::vector<HuffmanCodedPosAndEval> hcpevec;
+	s64 gameNum = 0;
+	s64 outNum = 0;
+	u64 offset = 0; // header の位置 (byte)
+
+	while (ifs.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		if (ifsIndex && (gameNum >= static_cast<s64>(index.size()) || index[gameNum] != offset)) {
+			std::cerr << "Error: index mismatch. game = " << gameNum << ", offset = " << offset << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		entries.resize(header.num);
+		if (!ifs.read(reinterpret_cast<char*>(entries.data()), sizeof(HuffmanCodedPosChainEntry) * header.num)) {
+			std::cerr << "Error: unexpected end of file. game = " << gameNum << ", offset = " << offset << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (!pos.set(header.hcp, nullptr)) {
+			std::cerr << "Error: incorrect Huffman code. game = " << gameNum << ", offset = " << offset << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		states.clear();
+
+		hcpevec.resize(header.num);
+		for (int i = 0; i < header.num; i++) {
+			HuffmanCodedPosAndEval& hcpe = hcpevec[i];
+			hcpe.hcp = (i == 0 ? header.hcp : pos.toHuffmanCodedPos());
+			hcpe.eval = entries[i].eval;
+			hcpe.bestMove16 = entries[i].bestMove16;
+			hcpe.gameResult = header.gameResult;
+
+			if (i + 1 < header.num) {
+				const Move move = move16toLegalMove(Move(entries[i].nextMove16), pos);
+				if (!move) {
+					std::cerr << "Error: illegal move. game = " << gameNum << ", offset = " << offset + sizeof(header) + sizeof(HuffmanCodedPosChainEntry) * i << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				states.emplace_back();
+				pos.doMove(move, states.back());
+			}
+		}
+		ofs.write(reinterpret_cast<char*>(hcpevec.data()), sizeof(HuffmanCodedPosAndEval) * header.num);
+		outNum += header.num;
+		offset += sizeof(header) + sizeof(HuffmanCodedPosChainEntry) * header.num;
+		gameNum++;
+	}
+
+	if (ifsIndex && gameNum != static_cast<s64>(index.size())) {
+		std::cerr << "Error: index mismatch. game num = " << gameNum << ", index num = " << index.size() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << "game num = " << gameNum << std::endl;
+	std::cout << "output num = " << outNum << std::endl;
+
+	return 0;
+}
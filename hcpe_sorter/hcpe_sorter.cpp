@@ -1,17 +1,65 @@
 ﻿#include "position.hpp"
+#include "shuffle.hpp"
 
 #include <algorithm>
 #include <random>
 #include <string>
+#include <cstring>
+
+// 入力全体をメモリに読み、複数のスレッドでシャッフルして num_per_file 件ずつ出力する。
+//
+// 1. 入力を BlockSize 件のブロックに分け、ブロック毎の乱数で各レコードのバケットを一様に選び、(ブロック, バケット) 毎の件数を数える。
+// 2. 件数の累積和から書き込み位置を決め、同じ乱数列をもう一度使って各レコードをバケットに振り分ける。
+// 3. バケット毎の乱数でバケット内をシャッフルする。シャッフルの済んだバケットが出力ファイル 1 つ分揃う度に、書き出す。
+// バケットを一様に選び、バケット内を一様にシャッフルして連結すると、全体も一様なランダム順列になる。
+// 乱数はシードとブロック、バケットの番号だけから決まるので、結果はスレッド数に依らずシードで再現できる。
+// 振り分け先の配列を使うので、メモリは入力ファイルの 2 倍使う。
+// シードと完成した出力ファイルは manifest ファイルに記録し、再実行時は検証の済んだ出力ファイルを書き直さない (shuffle.hpp)。
+
+namespace {
+	const s64 BlockSize = 1 << 20;
+	const int MaxBucketBits = 10;
+
+	// [0, n) を threadNum 個のスレッドで f(i) に分配する。
+	template <typename F>
+	void parallelFor(const s64 n, const int threadNum, F f) {
+		std::atomic<s64> next(0);
+		auto worker = [&]() {
+			for (s64 i; (i = next++) < n; )
+				f(i);
+		};
+		std::vector<std::thread> threads;
+		for (int t = 1; t < threadNum; t++)
+			threads.emplace_back(worker);
+		worker();
+		for (auto& th : threads)
+			th.join();
+	}
+}
 
 int main(int argc, char** argv)
 {
-	if (argc < 3) {
+	std::vector<char*> positional;
+	u64 seed = 0;
+	bool hasSeed = false;
+	int threadNum = std::max(1, (int)std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = std::strtoull(argv[++i], nullptr, 10);
+			hasSeed = true;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threadNum = std::max(1, std::atoi(argv[++i]));
+		else
+			positional.push_back(argv[i]);
+	}
+	if (positional.size() < 2 || std::atoll(positional[1]) <= 0) {
+		std::cout << "hcpe_sorter infile num_per_file [--seed N] [--threads N]" << std::endl;
 		return 1;
 	}
 
-	char* infile = argv[1];
-	int num_per_file = std::atoi(argv[2]);
+	char* infile = positional[0];
+	const s64 num_per_file = std::atoll(positional[1]);
 
 	std::ifstream ifs(infile, std::ifstream::in | std::ifstream::binary | std::ios::ate);
 	if (!ifs) {
@@ -22,33 +70,124 @@ int main(int argc, char** argv)
 
 	std::cout << entryNum << std::endl;
 
+	const s64 fileNum = (entryNum + num_per_file - 1) / num_per_file;
+	ShuffleManifest manifest(std::string(infile) + ".manifest", [&](const s64 i) {
+		std::ostringstream sout;
+		sout << infile << "-" << std::setfill('0') << std::setw(3) << i + 1;
+		return sout.str();
+	});
+	manifest.setParam("mode", "sorter");
+	manifest.setParam("record_size", sizeof(HuffmanCodedPosAndEval));
+	manifest.setParam("entry_num", entryNum);
+	manifest.setParam("num_per_file", num_per_file);
+	if (!manifest.open(hasSeed, seed))
+		return 1;
+	seed = manifest.seed();
+	const std::vector<char> shardDone = shuffleDoneShards(manifest, fileNum);
+	if (std::count(shardDone.begin(), shardDone.end(), 1) == fileNum)
+		return 0;
+
 	// 全て読む
 	ifs.seekg(std::ios_base::beg);
-	HuffmanCodedPosAndEval *hcpevec = new HuffmanCodedPosAndEval[entryNum];
-	ifs.read(reinterpret_cast<char*>(hcpevec), sizeof(HuffmanCodedPosAndEval) * entryNum);
+	std::unique_ptr<HuffmanCodedPosAndEval[]> inhcpevec(new HuffmanCodedPosAndEval[entryNum]);
+	ifs.read(reinterpret_cast<char*>(inhcpevec.get()), sizeof(HuffmanCodedPosAndEval) * entryNum);
 	ifs.close();
 
 	// shuffle
-	std::random_device seed_gen;
-	std::mt19937 engine(seed_gen());
-	std::shuffle(hcpevec, hcpevec + entryNum, engine);
+	const s64 blockNum = (entryNum + BlockSize - 1) / BlockSize;
+	// バケットは 2^18 件程度にする。乱数の上位 bit でバケットを選ぶので 2 のべき乗個。
+	int bucketBits = 0;
+	while (bucketBits < MaxBucketBits && (entryNum >> (18 + bucketBits)) > 0)
+		bucketBits++;
+	const s64 bucketNum = 1LL << bucketBits;
+	auto blockRange = [&](const s64 block) {
+		return std::make_pair(BlockSize * block, std::min(entryNum, BlockSize * (block + 1)));
+	};
+
+	// 1. (ブロック, バケット) 毎の件数
+	std::vector<s64> offsets(blockNum * bucketNum);
+	parallelFor(blockNum, threadNum, [&](const s64 block) {
+		ShuffleRandom random(seed, 0, block);
+		s64* counts = &offsets[block * bucketNum];
+		const auto range = blockRange(block);
+		for (s64 i = range.first; i < range.second; i++)
+			counts[random.bits(bucketBits)]++;
+	});
+	// バケット順、バケット内はブロック順に並べる。
+	std::vector<s64> bucketBegin(bucketNum + 1);
+	s64 sum = 0;
+	for (s64 b = 0; b < bucketNum; b++) {
+		bucketBegin[b] = sum;
+		for (s64 block = 0; block < blockNum; block++) {
+			const s64 count = offsets[block * bucketNum + b];
+			offsets[block * bucketNum + b] = sum;
+			sum += count;
+		}
+	}
+	bucketBegin[bucketNum] = sum;
+
+	// 2. 振り分け
+	std::unique_ptr<HuffmanCodedPosAndEval[]> hcpevec(new HuffmanCodedPosAndEval[entryNum]);
+	parallelFor(blockNum, threadNum, [&](const s64 block) {
+		ShuffleRandom random(seed, 0, block);
+		s64* positions = &offsets[block * bucketNum];
+		const auto range = blockRange(block);
+		for (s64 i = range.first; i < range.second; i++)
+			hcpevec[positions[random.bits(bucketBits)]++] = inhcpevec[i];
+	});
+	inhcpevec.reset();
+
+	// 3. バケット内のシャッフルと出力
+	// 先頭から連続してシャッフルの済んだバケットの数を doneNum に数え、出力ファイル 1 つ分揃ったら書き出す。
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<char> done(bucketNum);
+	s64 doneNum = 0;
+	std::thread shuffler([&]() {
+		parallelFor(bucketNum, threadNum, [&](const s64 b) {
+			ShuffleRandom random(seed, 1, b);
+			HuffmanCodedPosAndEval* bucket = hcpevec.get() + bucketBegin[b];
+			shuffleRecords(bucket, bucketBegin[b + 1] - bucketBegin[b], random);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			done[b] = 1;
+			while (doneNum < bucketNum && done[doneNum])
+				doneNum++;
+			cond.notify_one();
+		});
+	});
 
 	// 出力
-	for (int i = 0; i < (entryNum + num_per_file - 1) / num_per_file; i++, hcpevec += num_per_file) {
-		std::ostringstream sout;
-		sout << infile << "-" << std::setfill('0') << std::setw(3) << i + 1;
-		std::ofstream ofs(sout.str(), std::ios::binary);
-		if (!ofs) {
-			std::cerr << "Error: cannot open " << sout.str() << std::endl;
-			exit(EXIT_FAILURE);
+	int result = 0;
+	for (s64 i = 0; i < fileNum && result == 0; i++) {
+		if (shardDone[i])
+			continue;
+		const s64 begin = num_per_file * i;
+		const s64 num = std::min(num_per_file, entryNum - begin);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [&]() { return bucketBegin[doneNum] >= begin + num; });
 		}
-		int num = num_per_file;
-		if (num_per_file * (i + 1) > entryNum) {
-			num = entryNum - num_per_file * i;
+		const std::string outfile = manifest.shardFileName(i);
+		std::ofstream ofs(outfile, std::ios::binary);
+		if (!ofs) {
+			std::cerr << "Error: cannot open " << outfile << std::endl;
+			result = 1;
+			break;
 		}
 		std::cout << num << std::endl;
-		ofs.write(reinterpret_cast<char*>(hcpevec), sizeof(HuffmanCodedPosAndEval) * num);
+		ofs.write(reinterpret_cast<char*>(hcpevec.get() + begin), sizeof(HuffmanCodedPosAndEval) * num);
+		ofs.close();
+		if (!ofs) {
+			std::cerr << "Error: cannot write " << outfile << std::endl;
+			result = 1;
+			break;
+		}
+		const u64 hash = shuffleChecksum(hcpevec.get() + begin, sizeof(HuffmanCodedPosAndEval) * num);
+		if (!manifest.markDone(i, sizeof(HuffmanCodedPosAndEval) * num, hash))
+			result = 1;
 	}
+	shuffler.join();
 
-	return 0;
-}
\ No newline at end of file
+	return result;
+}
@@ -0,0 +1,127 @@
+﻿#include "init.hpp"
+#include "position.hpp"
+#include "move.hpp"
+#include "generateMoves.hpp"
+#include <deque>
+#include <iostream>
+
+// pos から指して nextKey の局面になる指し手を探す。見つからなければ moveNone を返す。
+Move findNextMove(const Position& pos, const u16 bestMove16, const Key nextKey) {
+	// 自己対局では最善手を指していることが多いので、先に調べる
+	const Move bestMove = move16toLegalMove(Move(bestMove16), pos);
+	if (bestMove && pos.getKeyAfter(bestMove) == nextKey)
+		return bestMove;
+
+	for (MoveList<Legal> ml(pos); !ml.end(); ++ml) {
+		if (pos.getKeyAfter(ml.move()) == nextKey)
+			return ml.move();
+	}
+	return Move::moveNone();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		std::cout << "hcpe_to_hcpc hcpeFile hcpcFile" << std::endl;
+		return 0;
+	}
+
+	char* hcpeFile = argv[1];
+	char* hcpcFile = argv[2];
+	const std::string indexFile = std::string(hcpcFile) + ".idx";
+
+	std::ifstream ifs(hcpeFile, std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << hcpeFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	const s64 entryNum = ifs.tellg() / sizeof(HuffmanCodedPosAndEval);
+	ifs.seekg(0);
+	std::cout << "input num = " << entryNum << std::endl;
+
+	std::ofstream ofs(hcpcFile, std::ios::binary);
+	if (!ofs) {
+		std::cerr << "Error: cannot open " << hcpcFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	// 対局毎の開始位置 (byte)
+	std::ofstream ofsIndex(indexFile, std::ios::binary);
+	if (!ofsIndex) {
+		std::cerr << "Error: cannot open " << indexFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
+	const s64 num_per_file = 1024 * 1024 * 1024 / sizeof(HuffmanCodedPosAndEval); // 1GB
+	std::vector<HuffmanCodedPosAndEval> inhcpevec(std::min(num_per_file, entryNum));
+
+	Position pos;
+	std::deque<StateInfo> states;
+	HuffmanCodedPosChainHeader header;
+	std::vector<HuffmanCodedPosChainEntry> entries;
+	u64 offset = 0;
+	s64 gameNum = 0;
+
+	auto writeChain = [&]() {
+		if (entries.empty())
+			return;
+		header.num = static_cast<u16>(entries.size());
+		ofsIndex.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+		ofs.write(reinterpret_cast<char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<char*>(entries.data()), sizeof(HuffmanCodedPosChainEntry) * entries.size());
+		offset += sizeof(header) + sizeof(HuffmanCodedPosChainEntry) * entries.size();
+		entries.clear();
+		gameNum++;
+	};
+
+	for (s64 i = 0; i < entryNum; i += inhcpevec.size()) {
+		const s64 num = std::min<s64>(inhcpevec.size(), entryNum - i);
+		ifs.read(reinterpret_cast<char*>(inhcpevec.data()), sizeof(HuffmanCodedPosAndEval) * num);
+
+		for (s64 d = 0; d < num; d++) {
+			const HuffmanCodedPosAndEval& hcpe = inhcpevec[d];
+			Key key;
+			if (!Position::getKey(hcpe.hcp, key)) {
+				std::cerr << "incorrect Huffman code. index = " << i + d << std::endl;
+				continue;
+			}
+
+			// 前の局面から 1 手指した局面なら、同じ対局として繋げる
+			Move move = Move::moveNone();
+			if (!entries.empty()
+				&& entries.size() < std::numeric_limits<u16>::max()
+				&& hcpe.gameResult == header.gameResult)
+				move = findNextMove(pos, entries.back().bestMove16, key);
+			if (move) {
+				states.emplace_back();
+				pos.doMove(move, states.back());
+				// 符号が完全に一致するときだけ繋げる (復元したときに同じデータにするため)
+				const HuffmanCodedPos hcp = pos.toHuffmanCodedPos();
+				if (std::memcmp(hcp.data, hcpe.hcp.data, sizeof(hcp.data)) != 0)
+					move = Move::moveNone();
+			}
+
+			if (move) {
+				entries.back().nextMove16 = static_cast<u16>(move.value());
+			}
+			else {
+				writeChain();
+				pos.set(hcpe.hcp, nullptr);
+				states.clear();
+				header.hcp = hcpe.hcp;
+				header.gameResult = hcpe.gameResult;
+				header.padding = 0;
+			}
+			entries.push_back({ hcpe.eval, hcpe.bestMove16, 0 });
+		}
+	}
+	writeChain();
+
+	std::cout << "game num = " << gameNum << std::endl;
+	std::cout << "output size = " << offset << std::endl;
+
+	return 0;
+}
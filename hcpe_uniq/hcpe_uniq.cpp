@@ -1,42 +1,12 @@
-﻿#include "position.hpp"
+﻿#include "init.hpp"
+#include "position.hpp"
 
-bool operator <(const HuffmanCodedPosAndEval& l, const HuffmanCodedPosAndEval& r) {
-	const long long* lhcp = (const long long*)&l.hcp;
-	const long long* rhcp = (const long long*)&r.hcp;
-
-	for (int i = 0; i < 4; i++) {
-		if (lhcp[i] < rhcp[i])
-			return true;
-		else if (lhcp[i] > rhcp[i])
-			return false;
-	}
-
-	const u16* lbestMove16 = (const u16*)l.bestMove16;
-	const u16* rbestMove16 = (const u16*)r.bestMove16;
-
-	if (lbestMove16 < rbestMove16)
-		return true;
-
-	return false;
-}
-
-bool operator ==(const HuffmanCodedPosAndEval& l, const HuffmanCodedPosAndEval& r) {
-	const long long* lhcp = (const long long*)&l.hcp;
-	const long long* rhcp = (const long long*)&r.hcp;
-
-	for (int i = 0; i < 4; i++) {
-		if (lhcp[i] != rhcp[i])
-			return false;
-	}
-
-	const u16* lbestMove16 = (const u16*)l.bestMove16;
-	const u16* rbestMove16 = (const u16*)r.bestMove16;
-
-	if (lbestMove16 != rbestMove16)
-		return false;
-
-	return true;
-}
+// 局面のハッシュ値と最善手で並べ、同じものは hcp のバイト列を比較して重複を判定する
+struct KeyAndIndex {
+	Key key;
+	u16 bestMove16;
+	s64 index;
+};
 
 int main(int argc, char** argv)
 {
@@ -63,12 +33,41 @@ int main(int argc, char** argv)
 	ifs.read(reinterpret_cast<char*>(hcpevec), sizeof(HuffmanCodedPosAndEval) * entryNum);
 	ifs.close();
 
-	// ソート
-	std::sort(hcpevec, hcpevec + entryNum);
-
-	// uniq
-	HuffmanCodedPosAndEval* end = std::unique(hcpevec, hcpevec + entryNum);
-	const s64 uniqNum = end - hcpevec;
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
+	// (ハッシュ値, 最善手, hcp, 出現順) でソート
+	// ハッシュ値は衝突し得るので、ハッシュ値が一致しても hcp が異なれば別の局面とする。
+	// 不正な符号の局面はハッシュ値を 0 とし、hcp のバイト列だけで比較する。
+	std::vector<KeyAndIndex> keys(entryNum);
+	std::vector<char> uniq(entryNum, 1);
+	for (s64 i = 0; i < entryNum; i++) {
+		Key key;
+		if (!Position::getKey(hcpevec[i].hcp, key))
+			key = 0;
+		keys[i] = { key, hcpevec[i].bestMove16, i };
+	}
+	const auto compareHcp = [hcpevec](const KeyAndIndex& l, const KeyAndIndex& r) {
+		return std::memcmp(hcpevec[l.index].hcp.data, hcpevec[r.index].hcp.data, sizeof(HuffmanCodedPos));
+	};
+	std::sort(keys.begin(), keys.end(), [&compareHcp](const KeyAndIndex& l, const KeyAndIndex& r) {
+		if (l.key != r.key)
+			return l.key < r.key;
+		if (l.bestMove16 != r.bestMove16)
+			return l.bestMove16 < r.bestMove16;
+		const int c = compareHcp(l, r);
+		if (c != 0)
+			return c < 0;
+		return l.index < r.index;
+	});
+
+	// uniq (最初に出現したものを残す)
+	for (s64 i = 1; i < entryNum; i++) {
+		if (keys[i].key == keys[i - 1].key && keys[i].bestMove16 == keys[i - 1].bestMove16 && compareHcp(keys[i], keys[i - 1]) == 0)
+			uniq[keys[i].index] = 0;
+	}
+	const s64 uniqNum = std::count(uniq.begin(), uniq.end(), 1);
 
 	std::cout << uniqNum << std::endl;
 
@@ -78,7 +77,10 @@ int main(int argc, char** argv)
 		std::cerr << "Error: cannot open " << outfile << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	ofs.write(reinterpret_cast<char*>(hcpevec), sizeof(HuffmanCodedPosAndEval) * uniqNum);
+	for (s64 i = 0; i < entryNum; i++) {
+		if (uniq[i])
+			ofs.write(reinterpret_cast<char*>(&hcpevec[i]), sizeof(HuffmanCodedPosAndEval));
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 import numpy as np
 import hcp_decoder
 import os
+import sys
 import argparse
 
 parser = argparse.ArgumentParser()
@@ -21,4 +22,5 @@ if args.num is None:
 else:
     len = args.num
 
-hcp_decoder.print_sfen_from_hcp(hcpvec[0:len])
+sys.stdout.flush()
+sys.stdout.buffer.write(hcp_decoder.hcp_to_sfen_bytes(hcpvec[0:len]))
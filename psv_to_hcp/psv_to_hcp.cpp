@@ -33,13 +33,12 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	initTable();
-	Position::initZobrist();
+	HuffmanCodedPos::init();
 	PackedSfen::init();
 
 	s64 outNum = 0;
 	s64 d = 0;
-	Position pos;
+	HuffmanCodedPos hcp;
 	for (s64 i = 0; i < entryNum; i++, d++) {
 		if (i % num_per_file == 0) {
 			s64 num = num_per_file;
@@ -50,8 +49,11 @@ int main(int argc, char *argv[])
 		}
 		PackedSfenValue& psv = inpsvvec[d];
 		if (std::abs(psv.score) < evalThreshold || psv.gamePly <= maxPly) {
-			pos.set(psv.sfen, nullptr);
-			ofs.write(reinterpret_cast<char*>(&pos.toHuffmanCodedPos()), sizeof(HuffmanCodedPos));
+			if (!packedSfenToHuffmanCodedPos(psv.sfen, hcp)) {
+				std::cerr << "incorrect Huffman code. index = " << i << std::endl;
+				continue;
+			}
+			ofs.write(reinterpret_cast<char*>(&hcp), sizeof(HuffmanCodedPos));
 			outNum++;
 		}
 	}
@@ -1,6 +1,7 @@
 #include "position.hpp"
 #include "init.hpp"
 #include "generateMoves.hpp"
+#include "features.hpp"
 
 #include <iostream>
 
@@ -81,4 +82,139 @@ int main() {
 
 	return 0;
 }
-#endif
\ No newline at end of file
+#endif
+
+#if 0
+// HuffmanCodedPos ̃fR[hxv
+// test hcpFile
+//  hcp t@Cɑ΂ĎsAύXO positions/sec rB
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::cout << "test hcpFile" << std::endl;
+		return 0;
+	}
+
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
+	std::ifstream ifs(argv[1], std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << argv[1] << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	const s64 entryNum = ifs.tellg() / sizeof(HuffmanCodedPos);
+	ifs.seekg(0);
+	std::vector<HuffmanCodedPos> hcpvec(entryNum);
+	ifs.read(reinterpret_cast<char*>(hcpvec.data()), sizeof(HuffmanCodedPos) * entryNum);
+
+	Position pos;
+	s64 checkNum = 0; // œKŏȂ悤Ɍʂg
+	const auto start = std::chrono::high_resolution_clock::now();
+	for (const HuffmanCodedPos& hcp : hcpvec) {
+		pos.set(hcp, nullptr);
+		checkNum += pos.inCheck();
+	}
+	const auto end = std::chrono::high_resolution_clock::now();
+	const double elapsed = std::chrono::duration<double>(end - start).count();
+
+	std::cout << "positions = " << entryNum << std::endl;
+	std::cout << "in check = " << checkNum << std::endl;
+	std::cout << "elapsed = " << elapsed << " [sec]" << std::endl;
+	std::cout << entryNum / elapsed << " [positions/sec]" << std::endl;
+
+	return 0;
+}
+#endif
+
+#if 0
+// make_input_features ̑xv
+// test hcpFile
+// ̎ޖ 81  isSet() ŒׂĂύXO̎ƔrBʂv邱ƂmFB
+template <typename POSITION>
+void make_input_features_old(const POSITION& position, float(*features1)[ColorNum][PieceTypeNum - 1][SquareNum], float(*features2)[MAX_FEATURES2_NUM][SquareNum]) {
+	for (Color c = Black; c < ColorNum; ++c) {
+		Color c2 = c;
+		if (position.turn() == White) {
+			c2 = oppositeColor(c);
+		}
+
+		for (PieceType pt = Pawn; pt < PieceTypeNum; ++pt) {
+			Bitboard bb = position.bbOf(pt, c);
+			for (Square sq = SQ11; sq < SquareNum; ++sq) {
+				Square sq2 = sq;
+				if (position.turn() == White) {
+					sq2 = SQ99 - sq;
+				}
+
+				if (bb.isSet(sq)) {
+					(*features1)[c2][pt - 1][sq2] = 1.0f;
+				}
+			}
+		}
+	}
+
+	make_input_features2(position, features2);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::cout << "test hcpFile" << std::endl;
+		return 0;
+	}
+
+	initTable();
+	Position::initZobrist();
+	HuffmanCodedPos::init();
+
+	std::ifstream ifs(argv[1], std::ifstream::in | std::ifstream::binary | std::ios::ate);
+	if (!ifs) {
+		std::cerr << "Error: cannot open " << argv[1] << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	// Ֆʂ̕vɊ܂߂Ȃ悤ɁA BoardOnlyPosition ɂĂB
+	const s64 entryNum = std::min<s64>(ifs.tellg() / sizeof(HuffmanCodedPos), 100000);
+	ifs.seekg(0);
+	std::vector<HuffmanCodedPos> hcpvec(entryNum);
+	ifs.read(reinterpret_cast<char*>(hcpvec.data()), sizeof(HuffmanCodedPos) * entryNum);
+	std::vector<BoardOnlyPosition> positions(entryNum);
+	for (s64 i = 0; i < entryNum; i++)
+		positions[i].set(hcpvec[i]);
+
+	static float features1[2][ColorNum][PieceTypeNum - 1][SquareNum];
+	static float features2[2][MAX_FEATURES2_NUM][SquareNum];
+
+	// ʂ̊mF
+	for (const BoardOnlyPosition& pos : positions) {
+		std::memset(features1, 0, sizeof(features1));
+		std::memset(features2, 0, sizeof(features2));
+		make_input_features_old(pos, features1 + 0, features2 + 0);
+		make_input_features(pos, features1 + 1, features2 + 1);
+		if (std::memcmp(features1[0], features1[1], sizeof(features1[0])) != 0 || std::memcmp(features2[0], features2[1], sizeof(features2[0])) != 0) {
+			std::cerr << "Error: features mismatch" << std::endl;
+			return 1;
+		}
+	}
+
+	const int repeat = 10;
+	auto bench = [&](const char* name, auto f) {
+		float checkSum = 0; // œKŏȂ悤Ɍʂg
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeat; r++) {
+			for (const BoardOnlyPosition& pos : positions) {
+				std::memset(features1[0], 0, sizeof(features1[0]));
+				std::memset(features2[0], 0, sizeof(features2[0]));
+				f(pos);
+				checkSum += features1[0][Black][Pawn - 1][SQ17];
+			}
+		}
+		const auto end = std::chrono::high_resolution_clock::now();
+		const double elapsed = std::chrono::duration<double>(end - start).count();
+		std::cout << name << " : " << entryNum * repeat / elapsed << " [positions/sec] (" << checkSum << ")" << std::endl;
+	};
+	bench("old", [&](const BoardOnlyPosition& pos) { make_input_features_old(pos, features1 + 0, features2 + 0); });
+	bench("new", [&](const BoardOnlyPosition& pos) { make_input_features(pos, features1 + 0, features2 + 0); });
+
+	return 0;
+}
+#endif